@@ -5,17 +5,79 @@
 #include <tuple>
 #include <memory>
 #include <unordered_map>
+#include <iterator>
+#include <stdexcept>
+#include <span>
+#include <functional>
 
 enum class EStoozeyVersion {
     INVALID,
     V1,
-    V2
+    V2,
+    // Partial blocks at the right and bottom edges get cells of their own.
+    // Files are only written as V3 when there are any, and as V2 otherwise.
+    V3
 };
 
 enum class EStoozeyImageMode {
     L,
     RGB,
     RGBA,
+    // Runs store a single byte index into a palette of up to 256 RGBA colors.
+    INDEXED,
+};
+
+// Layouts of raw 8-bit pixel buffers that frames can be filled from.
+enum class EStoozeyPixelFormat {
+    RGBA8,
+    BGRA8,
+    RGB8,
+    LA8,
+    L8
+};
+
+int GetBytesPerPixel(EStoozeyPixelFormat format);
+
+// How the pixels of each frame are laid out before compression.
+enum class EStoozeyEncoding {
+    // (count, pixel) runs.
+    RLE,
+    // Packets that either repeat one pixel or carry a span of literal pixels.
+    PACKBITS,
+    // Every cell stored raw, each row run through a PNG-style predictor
+    // (none, sub, up or paeth) picked for it. Suits gradients and shading.
+    FILTERED,
+    // Each channel run-length encoded as a plane of its own, alpha first, so
+    // anti-aliased edges don't break up the color runs.
+    PLANAR,
+    // QOI-style opcodes (color cache, small differences, runs), stored
+    // without zlib. Much faster to pack and load, at some cost in size.
+    QOI,
+};
+
+// Order the run encodings visit the cells of a full frame in. Blobby sprites
+// get much longer runs out of the locality preserving ones, which walk the
+// grid in 16x16 tiles, row by row.
+enum class EStoozeyScanOrder {
+    ROW,
+    COLUMN,
+    ZORDER,
+    HILBERT,
+};
+
+// Id of the codec the image data after the headers is compressed with.
+// Values past these are free for codecs registered with SStoz::RegisterCodec.
+enum class EStoozeyCompression {
+    ZLIB,
+    // Stored as is, for data that deflate can't do much with.
+    STORE,
+};
+
+// Maps onto zlib's Z_DEFAULT_STRATEGY, Z_FILTERED and Z_RLE.
+enum class EStoozeyDeflateStrategy {
+    DEFAULT,
+    FILTERED,
+    RLE,
 };
 
 enum class EStoozeyHeaderValue {
@@ -25,47 +87,173 @@ enum class EStoozeyHeaderValue {
     HEIGHT,
     PIXEL_SIZE,
     FRAME_COUNT,
-    FRAME_DURATION
+    FRAME_DURATION,
+    // Only written when it isn't the default, so plain files stay readable everywhere.
+    ENCODING,
+    SCAN_ORDER,
+    COMPRESSION,
+    // Id of the preset deflate dictionary, see SStoz::RegisterDictionary.
+    DICTIONARY
 };
 
+struct z_stream_s;
+
 class SStoozeySaveVector {
     public:
         SStoozeySaveVector(int capacity);
+        // Reuses the memory of a buffer that's no longer needed.
+        SStoozeySaveVector(std::vector<uint8_t> buffer);
         void u8(uint8_t value);
         void uleb128(unsigned int value);
         void str(const std::string& value);
+        void bytes(const uint8_t* value, size_t size);
 
-        void Compress();
+        // Leaves the data alone and returns false when deflate doesn't shrink it,
+        // or when should_stop(consumed, total, written) gives up on it midway.
+        bool Compress(std::span<const uint8_t> dictionary = {}, int level = 9, EStoozeyDeflateStrategy strategy = EStoozeyDeflateStrategy::DEFAULT, const std::function<bool(size_t, size_t, size_t)>& should_stop = {});
+        // Same, but spends far longer searching for the smallest deflate stream.
+        bool CompressOptimal(std::span<const uint8_t> dictionary = {}, int iterations = 15);
+        // Compressed size over raw size from a quick trial on a sample of the data.
+        float EstimateCompressionRatio();
         std::vector<uint8_t> GetData();
+        const uint8_t* GetPointer() { return this->data.data(); }
+        size_t GetSize() { return this->data.size(); }
+        // Swaps the contents for a codec's output.
+        void Replace(std::vector<uint8_t> data);
 
     private:
         unsigned int offset;
         std::vector<uint8_t> data;
+
+        friend class SStoozeyEncoder;
 };
 
 class SStoozeyLoadVector {
     public:
         SStoozeyLoadVector(const char* filename);
+        // Reads the file into a buffer that's no longer needed, reusing its memory.
+        SStoozeyLoadVector(const char* filename, std::vector<uint8_t> buffer);
         uint8_t u8();
         unsigned int uleb128();
         std::string str(unsigned int size);
 
-        void Decompress(unsigned int uncompressed_size);
+        void Decompress(unsigned int uncompressed_size, std::span<const uint8_t> dictionary = {});
         void Forward(unsigned int offset) { this->offset += offset;  }
         uint8_t* GetPointer() { return this->data.data() + this->offset; }
+        size_t GetRemaining() { return this->data.size() - this->offset; }
+        // Swaps the rest of the stream for a codec's output and starts reading it from the top.
+        void Replace(std::vector<uint8_t> data);
     private:
         unsigned int offset;
         std::vector<uint8_t> data;
+
+        friend class SStoozeyDecoder;
 };
 
 struct SStoozeyHeader {
-    EStoozeyVersion version = EStoozeyVersion::V2;
+    EStoozeyVersion version = EStoozeyVersion::V3;
     EStoozeyImageMode image_mode = EStoozeyImageMode::RGB;
     int width = 0;
     int height = 0;
     int pixel_size = 1;
     int frame_count = 1;
     int frame_duration = 0;
+    EStoozeyEncoding encoding = EStoozeyEncoding::RLE;
+    EStoozeyScanOrder scan_order = EStoozeyScanOrder::ROW;
+    EStoozeyCompression compression = EStoozeyCompression::ZLIB;
+    int dictionary = 0;
+
+    // Before V3 a partial block at the edge was folded into the cell before it.
+    int GetGridWidth() const { return this->version >= EStoozeyVersion::V3 ? (this->width + this->pixel_size - 1) / this->pixel_size : this->width / this->pixel_size; }
+    int GetGridHeight() const { return this->version >= EStoozeyVersion::V3 ? (this->height + this->pixel_size - 1) / this->pixel_size : this->height / this->pixel_size; }
+};
+
+struct SStoozeyLoadOptions {
+    // Keep the decoded runs of every frame alongside a per-row index into
+    // them, so SampleRLE can answer point queries without touching the grid.
+    bool build_row_index = false;
+    // Gather SStoozeyFrameStats from the runs while they're being decoded.
+    bool compute_stats = false;
+    // Skip the color planes of PLANAR images, leaving only alpha, for masks.
+    // Other encodings still decode every channel.
+    bool alpha_only = false;
+};
+
+// How 16-bit and HDR sources are brought down to 8 bits per channel.
+enum class EStoozeyQuantization {
+    ROUND,
+    ORDERED_DITHER
+};
+
+struct SStoozeyImportOptions {
+    // Pick the largest pixel_size the image is made of uniform blocks of, so
+    // upscaled pixel art is stored at its original resolution.
+    bool detect_pixel_size = true;
+    // Pick the narrowest image mode that's still lossless, L for gray images
+    // and RGB when the alpha channel is fully opaque.
+    bool detect_image_mode = true;
+    // Switch color images with at most 256 unique colors over to INDEXED,
+    // so long as the palette costs less than the run bytes it saves.
+    // GetImageData then returns RGBA rather than the source's channels.
+    bool detect_palette = false;
+    EStoozeyQuantization quantization = EStoozeyQuantization::ROUND;
+};
+
+enum class EStoozeyQuantizer {
+    MEDIAN_CUT,
+    // Median cut seeds, refined with k-means passes over the unique colors.
+    KMEANS
+};
+
+struct SStoozeyQuantizeOptions {
+    int color_count = 256;
+    EStoozeyQuantizer quantizer = EStoozeyQuantizer::MEDIAN_CUT;
+    int iterations = 4;
+    // Store the result as an INDEXED image, unless it's gray.
+    bool use_palette = true;
+};
+
+// Error is measured per channel over grid cells, against the image before quantization.
+struct SStoozeyQuantizeResult {
+    int color_count = 0;
+    double mse = 0.0;
+    double psnr = 0.0;
+};
+
+struct SStoozeyPackOptions {
+    EStoozeyEncoding encoding = EStoozeyEncoding::RLE;
+    // Ignored by FILTERED, PLANAR and QOI, which need whole rows. Delta rectangles are always
+    // scanned row by row.
+    EStoozeyScanOrder scan_order = EStoozeyScanOrder::ROW;
+    // Pack with every scan order and keep the smallest result.
+    bool search_scan_order = false;
+    // Store each animation frame as the rectangle that changed since the
+    // previous frame, falling back to a full frame when everything did.
+    bool delta_frames = false;
+    // Write frames identical to an earlier one as a reference to that frame.
+    bool repeat_frames = false;
+    // Codec for the image data, see SStoz::RegisterCodec.
+    EStoozeyCompression compression = EStoozeyCompression::ZLIB;
+    // Store the image data uncompressed when a quick trial says deflate would
+    // barely shrink it. Data any codec would grow is always stored.
+    bool allow_store = true;
+    // Registered dictionary to prime deflate with, 0 for none. Pays off for
+    // small images that share a lot of content with the dictionary.
+    int dictionary = 0;
+    // Replace zlib's encoder with an optimal parsing one, for release assets.
+    // Orders of magnitude slower, the output is still a plain zlib stream.
+    bool optimal_deflate = false;
+    // Passes of the optimal parser, each re-weighted by the one before.
+    int optimal_iterations = 15;
+    int compression_level = 9;
+    EStoozeyDeflateStrategy strategy = EStoozeyDeflateStrategy::DEFAULT;
+    // Try deflate levels and strategies, and every scan order too when
+    // search_scan_order is set, on all cores, and keep the smallest result.
+    // With optimal_deflate, the winner is recompressed by the optimal parser.
+    bool search_strategies = false;
+    // Past this, running candidates are dropped and no new ones start, 0 for
+    // no limit. The plain level 9 candidate always finishes.
+    int search_budget_ms = 0;
 };
 
 struct SStoozeyPixel {
@@ -75,8 +263,114 @@ struct SStoozeyPixel {
     uint8_t a = 0xff;
 };
 
+// Colors of an INDEXED image, along with the reverse lookup for encoding.
+struct SStoozeyPalette {
+    SStoozeyPalette(std::vector<SStoozeyPixel> colors);
+
+    uint8_t GetIndex(SStoozeyPixel pixel) const;
+
+    std::vector<SStoozeyPixel> colors;
+    std::unordered_map<uint32_t, uint8_t> indices;
+};
+
+struct SStoozeyRun {
+    // Index of the first grid cell covered by this run, in row-major order.
+    unsigned int start;
+    SStoozeyPixel pixel;
+};
+
+struct SStoozeyRunLength {
+    unsigned int count;
+    SStoozeyPixel pixel;
+};
+
+// Counts are in grid cells, the bounding box is in image pixels.
+struct SStoozeyFrameStats {
+    // Bounds of every cell that isn't fully transparent, zero sized if there are none.
+    int bbox_x = 0;
+    int bbox_y = 0;
+    int bbox_width = 0;
+    int bbox_height = 0;
+
+    unsigned int cell_count = 0;
+    unsigned int transparent_count = 0;
+    unsigned int opaque_count = 0;
+    unsigned int unique_colors = 0;
+
+    float GetCoverage() const { return this->cell_count ? (float) this->opaque_count / this->cell_count : 0.0f; }
+};
+
 using SStoozeyRow = std::vector<SStoozeyPixel>;
-using SStoozeyGrid = std::vector<SStoozeyRow>;
+
+// Rows are shared copy-on-write as well, so copying a grid only copies row
+// pointers and writing to it only duplicates the rows written to.
+class SStoozeyGrid {
+    public:
+        SStoozeyGrid(size_t height, const SStoozeyRow& row) {
+            this->rows.reserve(height);
+            for (size_t y = 0; y < height; ++y)
+                this->rows.push_back(std::make_shared<SStoozeyRow>(row));
+        }
+
+        const SStoozeyRow& operator[](size_t y) const { return *this->rows[y]; }
+        SStoozeyRow& GetMutableRow(size_t y) {
+            if (this->rows[y].use_count() > 1)
+                this->rows[y] = std::make_shared<SStoozeyRow>(*this->rows[y]);
+            return *this->rows[y];
+        }
+
+        size_t size() const { return this->rows.size(); }
+        bool empty() const { return this->rows.empty(); }
+    private:
+        std::vector<std::shared_ptr<SStoozeyRow>> rows;
+};
+
+class SStoozeyFrame;
+
+// Walks the (count, pixel) runs of a frame without allocating, either from an
+// in-memory frame or straight out of an inflated RLE stream. Runs from a frame
+// are maximal, runs from a stream are whatever the encoder wrote.
+class SStoozeyRunIterator {
+    public:
+        using value_type = SStoozeyRunLength;
+        using difference_type = std::ptrdiff_t;
+
+        SStoozeyRunIterator() = default;
+        SStoozeyRunIterator(SStoozeyFrame* frame);
+        // Consumes runs from the stream as it goes, leaving it at the frame end marker.
+        // INDEXED streams without a palette leave the raw index in r. PACKBITS
+        // literals come out as runs of one.
+        SStoozeyRunIterator(SStoozeyLoadVector* stream, EStoozeyImageMode image_mode, EStoozeyEncoding encoding, unsigned int cell_count, std::span<const SStoozeyPixel> palette = {});
+
+        const SStoozeyRunLength& operator*() const { return this->run; }
+        const SStoozeyRunLength* operator->() const { return &this->run; }
+        SStoozeyRunIterator& operator++() { this->Next(); return *this; }
+        void operator++(int) { this->Next(); }
+        bool operator==(std::default_sentinel_t) const { return this->done; }
+    private:
+        void Next();
+
+        SStoozeyFrame* frame = nullptr;
+        SStoozeyLoadVector* stream = nullptr;
+        EStoozeyImageMode image_mode = EStoozeyImageMode::RGBA;
+        EStoozeyEncoding encoding = EStoozeyEncoding::RLE;
+        std::span<const SStoozeyPixel> palette;
+        unsigned int literal_count = 0;
+
+        unsigned int cell = 0;
+        unsigned int cell_count = 0;
+        unsigned int run_index = 0;
+
+        SStoozeyRunLength run = {};
+        bool done = true;
+};
+
+struct SStoozeyRunRange {
+    SStoozeyRunIterator first;
+
+    SStoozeyRunIterator begin() const { return this->first; }
+    std::default_sentinel_t end() const { return std::default_sentinel; }
+};
 
 class SStoozeyFrame {
     public:
@@ -84,14 +378,61 @@ class SStoozeyFrame {
 
         SStoozeyPixel GetPixel(int x, int y);
         void SetPixel(int x, int y, SStoozeyPixel pixel);
-        void Pack(SStoozeySaveVector& stoz);
+        // Fills the whole frame from an image sized, row-major source, rows
+        // stride bytes apart. Channel counts map to L8, LA8, RGB8 and RGBA8.
+        void LoadPixels(const uint8_t* source, int channels, size_t stride);
+        void LoadPixels(const uint8_t* source, EStoozeyPixelFormat format, size_t stride);
+        void Pack(SStoozeySaveVector& stoz, EStoozeyEncoding encoding = EStoozeyEncoding::RLE, EStoozeyScanOrder scan_order = EStoozeyScanOrder::ROW);
+        // The rectangle is always row-major, the scan order is for frames that fall back to a full frame.
+        void PackDelta(SStoozeySaveVector& stoz, SStoozeyFrame& previous, EStoozeyEncoding encoding = EStoozeyEncoding::RLE, EStoozeyScanOrder scan_order = EStoozeyScanOrder::ROW);
+        // Delta frames are applied on top of the previous frame's grid.
+        void Unpack(SStoozeyLoadVector& stoz, SStoozeyLoadOptions options, SStoozeyFrame* previous = nullptr);
+
+        // Content hash of the grid, only meant for spotting candidate duplicates.
+        uint64_t Hash();
+        bool IsIdentical(SStoozeyFrame& other);
+        bool IsShared() { return this->grid.use_count() > 1; }
+
+        // Bounds of the cells that differ from the previous frame, as x, y, width, height in grid cells.
+        std::tuple<int, int, int, int> GetDirtyRect(SStoozeyFrame& previous);
+
+        // Looks up a pixel by binary searching the runs of a single grid row,
+        // the row index has to be built first, either by Load or BuildRowIndex.
+        SStoozeyPixel SampleRLE(int x, int y);
+        void BuildRowIndex();
+        bool HasRowIndex() { return !this->row_index.empty(); }
+
+        SStoozeyRunRange Runs() { return { SStoozeyRunIterator(this) }; }
+
+        // Cached result of ComputeFrameStats, dropped whenever the frame changes.
+        SStoozeyFrameStats GetStats();
+
+        // Every pixel of an INDEXED frame has to be one of the palette colors by the time it's packed.
+        void SetPalette(std::shared_ptr<const SStoozeyPalette> palette) { this->palette = palette; }
 
         int GetGridWidth() { return this->grid_width; }
         int GetGridHeight() { return this->grid_height;  }
     private:
         std::tuple<int, int> GetCellPosition(int x, int y);
+        SStoozeyGrid& GetMutableGrid();
+        // For writers that overwrite every cell.
+        SStoozeyGrid& GetOverwrittenGrid();
+        std::span<const SStoozeyPixel> GetPaletteColors();
+        void WriteRun(SStoozeySaveVector& stoz, unsigned int count, SStoozeyPixel pixel);
+        void WritePixel(SStoozeySaveVector& stoz, SStoozeyPixel pixel);
+        void PackRows(SStoozeySaveVector& stoz, int rect_x, int rect_y, int rect_width, int rect_height);
+        void UnpackRows(SStoozeyLoadVector& stoz, int rect_x, int rect_y, int rect_width, int rect_height);
+        void PackPlanes(SStoozeySaveVector& stoz, int rect_x, int rect_y, int rect_width, int rect_height);
+        void UnpackPlanes(SStoozeyLoadVector& stoz, int rect_x, int rect_y, int rect_width, int rect_height, bool alpha_only);
+        void PackQOI(SStoozeySaveVector& stoz, int rect_x, int rect_y, int rect_width, int rect_height);
+        void UnpackQOI(SStoozeyLoadVector& stoz, int rect_x, int rect_y, int rect_width, int rect_height);
+        void UnpackPackBits(SStoozeyLoadVector& stoz, int rect_x, int rect_y, int rect_width, int rect_height);
+        void UnpackDelta(SStoozeyLoadVector& stoz, SStoozeyLoadOptions options, SStoozeyFrame& previous);
 
         EStoozeyImageMode image_mode;
+        // What Unpack expects to find, Pack is told what to write.
+        EStoozeyEncoding encoding;
+        EStoozeyScanOrder scan_order;
 
         int image_width;
         int image_height;
@@ -101,26 +442,174 @@ class SStoozeyFrame {
 
         int pixel_size;
 
-        SStoozeyGrid grid;
+        // Shared between copies of the frame until one of them is written to.
+        std::shared_ptr<SStoozeyGrid> grid;
+        std::shared_ptr<const SStoozeyPalette> palette;
+
+        std::vector<SStoozeyRun> runs;
+        // First run overlapping each grid row, with one trailing entry
+        // holding the total run count.
+        std::vector<unsigned int> row_index;
+
+        SStoozeyFrameStats stats;
+        bool has_stats = false;
+
+        friend class SStoz;
+        friend class SStoozeyRunIterator;
+        friend class SStoozeyRunWriter;
+        friend class SStoozeyStatsAccumulator;
+        friend SStoozeyFrameStats ComputeFrameStats(SStoozeyFrame& frame);
+};
+
+SStoozeyFrameStats ComputeFrameStats(SStoozeyFrame& frame);
+
+template <typename Callback>
+void ForEachRun(SStoozeyFrame& frame, Callback&& callback) {
+    for (const SStoozeyRunLength& run : frame.Runs())
+        callback(run);
+}
+
+// Reads a single frame worth of runs out of an inflated stream, as left by
+// SStoz::Open, and moves the stream on to the next frame. Only full frames can
+// be read this way, delta frames need the previous frame to make sense of.
+// Runs come out in the header's scan order.
+template <typename Callback>
+void ForEachRun(SStoozeyLoadVector& stream, const SStoozeyHeader& header, Callback&& callback, std::span<const SStoozeyPixel> palette = {}) {
+    if (stream.str(3) != "IMS")
+        throw std::runtime_error("Expected frame start!");
+
+    unsigned int cell_count = header.GetGridWidth() * header.GetGridHeight();
+    SStoozeyRunRange runs = { SStoozeyRunIterator(&stream, header.image_mode, header.encoding, cell_count, palette) };
+    for (const SStoozeyRunLength& run : runs)
+        callback(run);
+
+    if (stream.str(3) != "IME")
+        throw std::runtime_error("Expected frame end!");
+}
+
+class SStoz;
+
+// Keeps a deflate state and scratch buffers alive between packs, so packing
+// thousands of small files doesn't set zlib up from scratch for each one.
+// Not thread safe, give each thread its own.
+class SStoozeyEncoder {
+    public:
+        SStoozeyEncoder();
+        ~SStoozeyEncoder();
+        SStoozeyEncoder(const SStoozeyEncoder&) = delete;
+        SStoozeyEncoder& operator=(const SStoozeyEncoder&) = delete;
+
+        std::vector<uint8_t> Pack(SStoz& stoz, SStoozeyPackOptions options = {});
+        // Same as SStoozeySaveVector::Compress.
+        bool Compress(SStoozeySaveVector& vector, std::span<const uint8_t> dictionary = {}, int level = 9, EStoozeyDeflateStrategy strategy = EStoozeyDeflateStrategy::DEFAULT, const std::function<bool(size_t, size_t, size_t)>& should_stop = {});
+        // Same as SStoozeySaveVector::EstimateCompressionRatio.
+        float EstimateCompressionRatio(SStoozeySaveVector& vector);
+    private:
+        z_stream_s& ResetStream(int level, EStoozeyDeflateStrategy strategy);
+        void Reclaim(SStoozeySaveVector& vector);
+
+        std::unique_ptr<z_stream_s> stream;
+        int level = 0;
+        EStoozeyDeflateStrategy strategy = EStoozeyDeflateStrategy::DEFAULT;
+        std::vector<uint8_t> output;
+        std::vector<uint8_t> frames;
+
+        friend class SStoz;
+};
+
+// The inflate side of SStoozeyEncoder, same rules apply.
+class SStoozeyDecoder {
+    public:
+        SStoozeyDecoder();
+        ~SStoozeyDecoder();
+        SStoozeyDecoder(const SStoozeyDecoder&) = delete;
+        SStoozeyDecoder& operator=(const SStoozeyDecoder&) = delete;
+
+        std::shared_ptr<SStoz> Load(const char* filename, SStoozeyLoadOptions options = {});
+        // Same as SStoozeyLoadVector::Decompress.
+        void Decompress(SStoozeyLoadVector& vector, unsigned int uncompressed_size, std::span<const uint8_t> dictionary = {});
+    private:
+        std::unique_ptr<z_stream_s> stream;
+        std::vector<uint8_t> file;
+        std::vector<uint8_t> output;
+};
+
+// Compresses the image data that follows the headers. Registered codecs are
+// shared between threads, per-thread state belongs in the encoder and decoder
+// contexts passed in, which codecs other than zlib are free to ignore.
+class SStoozeyCodec {
+    public:
+        virtual ~SStoozeyCodec() = default;
+
+        // Replaces the data with its compressed form, or leaves it alone and
+        // returns false when that wouldn't be smaller, so it gets stored instead.
+        virtual bool Compress(SStoozeySaveVector& data, const SStoozeyPackOptions& options, SStoozeyEncoder& encoder) = 0;
+        // Replaces the rest of the stream with the image data. The size is
+        // only an estimate, there's no uncompressed size in the file.
+        virtual void Decompress(SStoozeyLoadVector& data, unsigned int uncompressed_size, const SStoozeyHeader& header, SStoozeyDecoder& decoder) = 0;
 };
 
 class SStoz {
     public:
         SStoz(SStoozeyHeader header);
 
-        static std::shared_ptr<SStoz> Load(const char* filename);
-        static std::shared_ptr<SStoz> FromImage(const char* filename);
+        static std::shared_ptr<SStoz> Load(const char* filename, SStoozeyLoadOptions options = {});
+        // Parses the header and inflates the image data, leaving the stream at the first frame.
+        static SStoozeyHeader Open(SStoozeyLoadVector& stream, std::vector<SStoozeyPixel>* palette = nullptr, SStoozeyDecoder* decoder = nullptr);
+        // Animated GIFs come in with every frame.
+        static std::shared_ptr<SStoz> FromImage(const char* filename, SStoozeyImportOptions options = {});
+        // Preset deflate dictionaries have to be registered under the same id
+        // when packing and when loading. Id 0 means no dictionary.
+        static void RegisterDictionary(int id, std::vector<uint8_t> dictionary);
+        // Builds a dictionary of up to `size` bytes out of the image data most
+        // common across a corpus of STOZ files.
+        static std::vector<uint8_t> TrainDictionary(std::span<const std::string> filenames, size_t size = 0x8000);
+        // Codecs also have to be registered under the same id on both ends.
+        // ZLIB and STORE are built in and can't be replaced.
+        static void RegisterCodec(EStoozeyCompression id, std::shared_ptr<SStoozeyCodec> codec);
+
+        // One buffer per frame, the frame count comes from the span rather
+        // than the header. A stride of 0 means rows are tightly packed.
+        static std::shared_ptr<SStoz> FromPixels(SStoozeyHeader header, std::span<const uint8_t* const> frames, size_t stride, EStoozeyPixelFormat format);
 
         int GetWidth();
         int GetHeight();
         int GetFrameCount();
         EStoozeyImageMode GetImageMode();
+        EStoozeyEncoding GetEncoding();
+        EStoozeyScanOrder GetScanOrder();
+        EStoozeyCompression GetCompression();
+        int GetDictionary();
 
         bool IsAnimated();
 
+        SStoozeyFrame& GetFrame(int frame_index) { return this->frames[frame_index]; }
+
+        void SetPalette(std::vector<SStoozeyPixel> colors);
+        std::vector<SStoozeyPixel> GetPalette();
+
+        // Rows top to bottom, like FromPixels takes them. INDEXED images come out as RGBA, GetIndexData has the raw indices for a palette lookup on the consumer's side.
+        // API break: older versions returned the image transposed, column by column. Callers that transposed it back need to stop.
         std::vector<uint8_t> GetImageData(int frame_index);
-        std::vector<uint8_t> Pack();
+        std::vector<uint8_t> GetIndexData(int frame_index);
+        std::vector<uint8_t> Pack(SStoozeyPackOptions options = {});
+
+        // Lossy, reduces every frame to at most color_count colors so runs get
+        // longer, and reports how much error that introduced.
+        SStoozeyQuantizeResult Quantize(SStoozeyQuantizeOptions options = {});
     private:
+        void SetImageMode(EStoozeyImageMode image_mode);
+        void PackFrames(SStoozeySaveVector& image_vector, const SStoozeyPackOptions& options);
+        std::vector<uint8_t> PackFile(SStoozeySaveVector& image_vector, const SStoozeyPackOptions& options, EStoozeyCompression compression);
+        std::vector<uint8_t> PackSearch(SStoozeyPackOptions options);
+        std::vector<uint8_t> Pack(SStoozeyPackOptions options, SStoozeyEncoder& encoder);
+
+        static std::shared_ptr<SStoz> FromGif(const std::vector<uint8_t>& file, SStoozeyImportOptions options);
+
         std::unordered_map<EStoozeyHeaderValue, int> headers;
         std::vector<SStoozeyFrame> frames;
+        std::shared_ptr<const SStoozeyPalette> palette;
+
+        friend class SStoozeyEncoder;
+        friend class SStoozeyDecoder;
 };
\ No newline at end of file
@@ -3,18 +3,40 @@
 #include <iostream>
 #include "stb_image.h"
 #include <stoz.hpp>
+#include "stoz_deflate.hpp"
 #include <fstream>
 #include <functional>
+#include <algorithm>
+#include <unordered_set>
+#include <climits>
+#include <cstring>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <numeric>
+#include <cmath>
+#include <chrono>
+#include <optional>
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
 #include <zlib.h>
 
-SStoozeyLoadVector::SStoozeyLoadVector(const char* filename) {
+SStoozeyLoadVector::SStoozeyLoadVector(const char* filename) : SStoozeyLoadVector(filename, {}) {}
+
+SStoozeyLoadVector::SStoozeyLoadVector(const char* filename, std::vector<uint8_t> buffer) {
     this->offset = 0;
+    this->data = std::move(buffer);
 
     std::ifstream stream(filename, std::ios::in | std::ios::binary);
     if (!stream.good())
         throw std::runtime_error("File doesn't exist!");
 
-    this->data = std::vector<uint8_t>((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+    // Read in one go, going through istreambuf_iterator costs more than inflating.
+    stream.seekg(0, std::ios::end);
+    this->data.resize((size_t) stream.tellg());
+    stream.seekg(0, std::ios::beg);
+    stream.read((char*) this->data.data(), this->data.size());
 }
 
 uint8_t SStoozeyLoadVector::u8() { return this->data[this->offset++]; }
@@ -35,29 +57,34 @@ std::string SStoozeyLoadVector::str(unsigned int size) {
     this->offset += size;
     return s;
 }
-
-void SStoozeySaveVector::Compress() {
-    unsigned long compressed_data_size = this->data.size();
-    unsigned char* compressed_data = new unsigned char[compressed_data_size];
-    int result = compress2(compressed_data, &compressed_data_size, this->data.data(), compressed_data_size, Z_BEST_COMPRESSION);
-
-    this->data.clear();
-    this->data.insert(this->data.end(), (uint8_t*)(compressed_data), (uint8_t*)(compressed_data + compressed_data_size));
+void SStoozeyLoadVector::Replace(std::vector<uint8_t> data) {
+    this->data = std::move(data);
     this->offset = 0;
+}
 
-    delete[] compressed_data;
+bool SStoozeySaveVector::Compress(std::span<const uint8_t> dictionary, int level, EStoozeyDeflateStrategy strategy, const std::function<bool(size_t, size_t, size_t)>& should_stop) {
+    SStoozeyEncoder encoder;
+    return encoder.Compress(*this, dictionary, level, strategy, should_stop);
 }
 
-void SStoozeyLoadVector::Decompress(unsigned int uncompressed_size) {
-    unsigned long actual_size = uncompressed_size;
-    unsigned char* data = new unsigned char[uncompressed_size];
-    int result = uncompress(data, &actual_size, this->data.data() + this->offset, this->data.size() - this->offset);
+bool SStoozeySaveVector::CompressOptimal(std::span<const uint8_t> dictionary, int iterations) {
+    std::vector<uint8_t> compressed_data = DeflateOptimal(this->data, dictionary, iterations);
+    if (compressed_data.size() >= this->data.size())
+        return false;
 
-    this->data.clear();
-    this->data.insert(this->data.end(), (uint8_t*)(data), (uint8_t*)(data + actual_size));
+    this->data = std::move(compressed_data);
     this->offset = 0;
+    return true;
+}
+
+float SStoozeySaveVector::EstimateCompressionRatio() {
+    SStoozeyEncoder encoder;
+    return encoder.EstimateCompressionRatio(*this);
+}
 
-    delete[] data;
+void SStoozeyLoadVector::Decompress(unsigned int uncompressed_size, std::span<const uint8_t> dictionary) {
+    SStoozeyDecoder decoder;
+    decoder.Decompress(*this, uncompressed_size, dictionary);
 }
 
 SStoozeySaveVector::SStoozeySaveVector(int capacity) {
@@ -65,6 +92,12 @@ SStoozeySaveVector::SStoozeySaveVector(int capacity) {
     this->offset = 0;
 }
 
+SStoozeySaveVector::SStoozeySaveVector(std::vector<uint8_t> buffer) {
+    this->data = std::move(buffer);
+    this->data.clear();
+    this->offset = 0;
+}
+
 void SStoozeySaveVector::u8(uint8_t value) { this->data.push_back(value); }
 void SStoozeySaveVector::uleb128(unsigned int value) {
     while (true) {
@@ -79,8 +112,172 @@ void SStoozeySaveVector::str(const std::string& value) {
     for (auto& c : value)
         this->u8((uint8_t)c);
 }
+void SStoozeySaveVector::bytes(const uint8_t* value, size_t size) {
+    this->data.insert(this->data.end(), value, value + size);
+}
 
 std::vector<uint8_t> SStoozeySaveVector::GetData() { return this->data;  }
+void SStoozeySaveVector::Replace(std::vector<uint8_t> data) {
+    this->data = std::move(data);
+    this->offset = 0;
+}
+
+SStoozeyEncoder::SStoozeyEncoder() = default;
+SStoozeyEncoder::~SStoozeyEncoder() {
+    if (this->stream)
+        deflateEnd(this->stream.get());
+}
+
+z_stream& SStoozeyEncoder::ResetStream(int level, EStoozeyDeflateStrategy strategy) {
+    const int strategies[] = { Z_DEFAULT_STRATEGY, Z_FILTERED, Z_RLE };
+
+    // Set up once, after that a reset is enough. It keeps the window and hash
+    // tables, which is most of what deflateInit2 spends its time on.
+    if (!this->stream) {
+        this->stream = std::make_unique<z_stream>();
+        *this->stream = {};
+        if (deflateInit2(this->stream.get(), level, Z_DEFLATED, MAX_WBITS, 8, strategies[(int) strategy]) != Z_OK) {
+            this->stream.reset();
+            throw std::runtime_error("Failed to initialize zlib!");
+        }
+    } else {
+        deflateReset(this->stream.get());
+        if ((level != this->level || strategy != this->strategy) && deflateParams(this->stream.get(), level, strategies[(int) strategy]) != Z_OK)
+            throw std::runtime_error("Failed to initialize zlib!");
+    }
+    this->level = level;
+    this->strategy = strategy;
+    return *this->stream;
+}
+
+bool SStoozeyEncoder::Compress(SStoozeySaveVector& vector, std::span<const uint8_t> dictionary, int level, EStoozeyDeflateStrategy strategy, const std::function<bool(size_t, size_t, size_t)>& should_stop) {
+    std::vector<uint8_t>& data = vector.data;
+    z_stream& stream = this->ResetStream(level, strategy);
+    if (!dictionary.empty() && deflateSetDictionary(&stream, dictionary.data(), (uInt) dictionary.size()) != Z_OK)
+        throw std::runtime_error("Failed to set the dictionary!");
+
+    // High entropy data can come out bigger than it went in, so size for the worst case.
+    this->output.resize(deflateBound(&stream, (uLong) data.size()));
+    stream.next_out = this->output.data();
+    stream.avail_out = (uInt) this->output.size();
+
+    // Fed a slice at a time so should_stop gets a say in between.
+    const size_t slice_size = 0x10000;
+    int result = Z_OK;
+    for (size_t consumed = 0; result == Z_OK;) {
+        size_t slice = std::min(slice_size, data.size() - consumed);
+        stream.next_in = data.data() + consumed;
+        stream.avail_in = (uInt) slice;
+        consumed += slice;
+
+        bool last = consumed == data.size();
+        result = deflate(&stream, last ? Z_FINISH : Z_NO_FLUSH);
+        if (!last && should_stop && should_stop(consumed, data.size(), stream.total_out))
+            return false;
+    }
+    if (result != Z_STREAM_END)
+        throw std::runtime_error("Failed to compress image data!");
+
+    bool smaller = stream.total_out < data.size();
+    if (smaller) {
+        // The raw data's memory becomes the output buffer for the next call.
+        this->output.resize(stream.total_out);
+        std::swap(data, this->output);
+        vector.offset = 0;
+    }
+    return smaller;
+}
+
+float SStoozeyEncoder::EstimateCompressionRatio(SStoozeySaveVector& vector) {
+    // A fast deflate over a few slices spread through the data. It compresses
+    // worse than the real thing, so it only ever errs towards storing.
+    const size_t slice_size = 0x4000;
+    const int slice_count = 4;
+
+    const std::vector<uint8_t>& data = vector.data;
+    if (data.empty()) return 0.0f;
+
+    // The slices go to deflate straight out of the data, there's no sample to copy.
+    bool whole = data.size() <= slice_size * slice_count;
+    size_t sample_size = whole ? data.size() : slice_size * slice_count;
+    size_t step = whole ? 0 : (data.size() - slice_size) / (slice_count - 1);
+
+    z_stream& stream = this->ResetStream(1, EStoozeyDeflateStrategy::DEFAULT);
+    this->output.resize(deflateBound(&stream, (uLong) sample_size));
+    stream.next_out = this->output.data();
+    stream.avail_out = (uInt) this->output.size();
+
+    int result = Z_OK;
+    for (int i = 0; i < (whole ? 1 : slice_count) && result == Z_OK; ++i) {
+        stream.next_in = (Bytef*) data.data() + (i * step);
+        stream.avail_in = (uInt) (whole ? data.size() : slice_size);
+        result = deflate(&stream, (whole || i == slice_count - 1) ? Z_FINISH : Z_NO_FLUSH);
+    }
+    if (result != Z_STREAM_END)
+        return 1.0f;
+
+    return (float) stream.total_out / (float) sample_size;
+}
+
+void SStoozeyEncoder::Reclaim(SStoozeySaveVector& vector) {
+    this->frames = std::move(vector.data);
+    this->frames.clear();
+}
+
+std::vector<uint8_t> SStoozeyEncoder::Pack(SStoz& stoz, SStoozeyPackOptions options) {
+    return stoz.Pack(options, *this);
+}
+
+SStoozeyDecoder::SStoozeyDecoder() = default;
+SStoozeyDecoder::~SStoozeyDecoder() {
+    if (this->stream)
+        inflateEnd(this->stream.get());
+}
+
+void SStoozeyDecoder::Decompress(SStoozeyLoadVector& vector, unsigned int uncompressed_size, std::span<const uint8_t> dictionary) {
+    // The size is only an estimate, so inflate in steps and grow the output
+    // whenever it turns out to be too small, rather than truncating.
+    this->output.resize(std::max(uncompressed_size, 0x100u));
+    std::vector<uint8_t>& data = this->output;
+
+    if (!this->stream) {
+        this->stream = std::make_unique<z_stream>();
+        *this->stream = {};
+        if (inflateInit(this->stream.get()) != Z_OK) {
+            this->stream.reset();
+            throw std::runtime_error("Failed to initialize zlib!");
+        }
+    } else
+        inflateReset(this->stream.get());
+    z_stream& stream = *this->stream;
+    stream.next_in = vector.data.data() + vector.offset;
+    stream.avail_in = (uInt) (vector.data.size() - vector.offset);
+
+    int result = Z_OK;
+    while (result != Z_STREAM_END) {
+        if (stream.total_out == data.size())
+            data.resize(data.size() * 2);
+
+        stream.next_out = data.data() + stream.total_out;
+        stream.avail_out = (uInt) (data.size() - stream.total_out);
+
+        result = inflate(&stream, Z_NO_FLUSH);
+        if (result == Z_NEED_DICT) {
+            // zlib checks the dictionary against the checksum the encoder recorded.
+            if (dictionary.empty() || inflateSetDictionary(&stream, dictionary.data(), (uInt) dictionary.size()) != Z_OK)
+                throw std::runtime_error("Image data needs a different dictionary!");
+            result = Z_OK;
+            continue;
+        }
+        if (result != Z_OK && result != Z_STREAM_END)
+            throw std::runtime_error("Image data is corrupt!");
+    }
+
+    // The compressed data's memory becomes the output buffer for the next call.
+    data.resize(stream.total_out);
+    std::swap(vector.data, data);
+    vector.offset = 0;
+}
 
 SStoz::SStoz(SStoozeyHeader header) {
     this->headers[EStoozeyHeaderValue::VERSION] = (int) header.version;
@@ -90,11 +287,17 @@ SStoz::SStoz(SStoozeyHeader header) {
     this->headers[EStoozeyHeaderValue::PIXEL_SIZE] = header.pixel_size;
     this->headers[EStoozeyHeaderValue::FRAME_COUNT] = header.frame_count;
     this->headers[EStoozeyHeaderValue::FRAME_DURATION] = header.frame_duration;
-
-    this->frames = std::vector<SStoozeyFrame>();
-    this->frames.reserve(header.frame_count);
-    for (int i = 0; i < header.frame_count; ++i)
-        this->frames.push_back(SStoozeyFrame(header));
+    if (header.encoding != EStoozeyEncoding::RLE)
+        this->headers[EStoozeyHeaderValue::ENCODING] = (int) header.encoding;
+    if (header.scan_order != EStoozeyScanOrder::ROW)
+        this->headers[EStoozeyHeaderValue::SCAN_ORDER] = (int) header.scan_order;
+    if (header.compression != EStoozeyCompression::ZLIB)
+        this->headers[EStoozeyHeaderValue::COMPRESSION] = (int) header.compression;
+    if (header.dictionary != 0)
+        this->headers[EStoozeyHeaderValue::DICTIONARY] = header.dictionary;
+
+    // Every frame starts out sharing the same blank grid.
+    this->frames = std::vector<SStoozeyFrame>(header.frame_count, SStoozeyFrame(header));
 }
 
 int SStoz::GetWidth() { return this->headers[EStoozeyHeaderValue::WIDTH]; }
@@ -107,6 +310,26 @@ int SStoz::GetFrameCount() {
 EStoozeyImageMode SStoz::GetImageMode() { 
     return (EStoozeyImageMode)this->headers[EStoozeyHeaderValue::IMAGE_MODE];
 }
+EStoozeyEncoding SStoz::GetEncoding() {
+    if (this->headers.contains(EStoozeyHeaderValue::ENCODING))
+        return (EStoozeyEncoding)this->headers[EStoozeyHeaderValue::ENCODING];
+    return EStoozeyEncoding::RLE;
+}
+EStoozeyScanOrder SStoz::GetScanOrder() {
+    if (this->headers.contains(EStoozeyHeaderValue::SCAN_ORDER))
+        return (EStoozeyScanOrder)this->headers[EStoozeyHeaderValue::SCAN_ORDER];
+    return EStoozeyScanOrder::ROW;
+}
+int SStoz::GetDictionary() {
+    if (this->headers.contains(EStoozeyHeaderValue::DICTIONARY))
+        return this->headers[EStoozeyHeaderValue::DICTIONARY];
+    return 0;
+}
+EStoozeyCompression SStoz::GetCompression() {
+    if (this->headers.contains(EStoozeyHeaderValue::COMPRESSION))
+        return (EStoozeyCompression)this->headers[EStoozeyHeaderValue::COMPRESSION];
+    return EStoozeyCompression::ZLIB;
+}
 
 bool SStoz::IsAnimated() { return this->GetFrameCount() > 1; }
 
@@ -118,8 +341,8 @@ std::vector<uint8_t> SStoz::GetImageData(int frame_index) {
 
     data.reserve(width * height * 4);
     SStoozeyFrame& frame = this->frames[frame_index];
-    for (int x = 0; x < width; ++x) {
-        for (int y = 0; y < height; ++y) {
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
             SStoozeyPixel pixel = frame.GetPixel(x, y);
 
             if (image_mode == EStoozeyImageMode::L) {
@@ -134,226 +357,2638 @@ std::vector<uint8_t> SStoz::GetImageData(int frame_index) {
                 continue;
             }
 
-            if (image_mode == EStoozeyImageMode::RGBA) {
-                data.push_back(pixel.r);
-                data.push_back(pixel.g);
-                data.push_back(pixel.b);
-                data.push_back(pixel.a);
-                continue;
-            }
+            data.push_back(pixel.r);
+            data.push_back(pixel.g);
+            data.push_back(pixel.b);
+            data.push_back(pixel.a);
         }
     }
     return data;
 }
 
-void SStoozeyFrame::Pack(SStoozeySaveVector& stoz) {
-    stoz.str("IMS");
-    
-    EStoozeyImageMode image_mode = this->image_mode;
-    SStoozeyPixel pixel = this->GetPixel(0, 0);
-    int count = 0;
-
-    std::function<void()> write_block = [&] {
-        stoz.uleb128(count);
-
-        stoz.u8(pixel.r);
-        stoz.u8(pixel.g);
-        stoz.u8(pixel.b);
-        stoz.u8(pixel.a);
-    };
+std::vector<uint8_t> SStoz::GetIndexData(int frame_index) {
+    if (this->palette == nullptr)
+        throw std::runtime_error("Image doesn't have a palette!");
 
-    if (this->image_mode == EStoozeyImageMode::L) {
-        write_block = [&] {
-            stoz.uleb128(count);
-            stoz.u8(pixel.r);
-        };
+    int width = this->GetWidth(), height = this->GetHeight();
+    std::vector<uint8_t> data;
+    data.reserve(width * height);
+
+    SStoozeyFrame& frame = this->frames[frame_index];
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x)
+            data.push_back(this->palette->GetIndex(frame.GetPixel(x, y)));
     }
 
-    if (this->image_mode == EStoozeyImageMode::RGB) {
-        write_block = [&] {
-            stoz.uleb128(count);
+    return data;
+}
+
+void SStoz::SetPalette(std::vector<SStoozeyPixel> colors) {
+    if (colors.size() > 256)
+        throw std::runtime_error("Palette can't have more than 256 colors!");
 
-            stoz.u8(pixel.r);
-            stoz.u8(pixel.g);
-            stoz.u8(pixel.b);
-        };
+    this->palette = std::make_shared<const SStoozeyPalette>(std::move(colors));
+    for (auto& frame : this->frames)
+        frame.SetPalette(this->palette);
+}
+
+std::vector<SStoozeyPixel> SStoz::GetPalette() {
+    if (this->palette == nullptr) return {};
+    return this->palette->colors;
+}
+
+SStoozeyPalette::SStoozeyPalette(std::vector<SStoozeyPixel> colors) {
+    this->colors = std::move(colors);
+    for (size_t i = 0; i < this->colors.size(); ++i)
+        this->indices.emplace(*((uint32_t*)&this->colors[i]), (uint8_t) i);
+}
+
+uint8_t SStoozeyPalette::GetIndex(SStoozeyPixel pixel) const {
+    auto index = this->indices.find(*((uint32_t*)&pixel));
+    if (index == this->indices.end())
+        throw std::runtime_error("Pixel isn't in the palette!");
+    return index->second;
+}
+
+void SStoozeyFrame::WriteRun(SStoozeySaveVector& stoz, unsigned int count, SStoozeyPixel pixel) {
+    stoz.uleb128(count);
+    this->WritePixel(stoz, pixel);
+}
+
+void SStoozeyFrame::WritePixel(SStoozeySaveVector& stoz, SStoozeyPixel pixel) {
+    if (this->image_mode == EStoozeyImageMode::INDEXED) {
+        if (this->palette == nullptr)
+            throw std::runtime_error("Indexed frame doesn't have a palette!");
+        stoz.u8(this->palette->GetIndex(pixel));
+        return;
     }
 
-    for (int y = 0; y < this->grid_height; ++y) {
-        for (int x = 0; x < this->grid_width; ++x) {
-            SStoozeyPixel current_pixel = this->grid[y][x];
-            if (*((uint32_t*)&current_pixel) != *((uint32_t*)&pixel)) {
-                write_block();
-                pixel = current_pixel;
-                count = 0;
+    stoz.u8(pixel.r);
+    if (this->image_mode == EStoozeyImageMode::L) return;
+
+    stoz.u8(pixel.g);
+    stoz.u8(pixel.b);
+    if (this->image_mode == EStoozeyImageMode::RGB) return;
+
+    stoz.u8(pixel.a);
+}
+
+// Takes runs in scan order and writes them out in the given encoding. For
+// PACKBITS, short runs are gathered into literal packets, longer ones become
+// repeat packets. A packet starts with ((length - 1) << 1) | is_literal.
+class SStoozeyRunWriter {
+    public:
+        SStoozeyRunWriter(SStoozeyFrame& frame, SStoozeySaveVector& stoz, EStoozeyEncoding encoding) : frame(frame), stoz(stoz), encoding(encoding) {
+            // A repeat packet only pays off once it's cheaper than inlining the pixels.
+            this->min_repeat = (frame.image_mode == EStoozeyImageMode::L || frame.image_mode == EStoozeyImageMode::INDEXED) ? 3 : 2;
+        }
+
+        void Add(unsigned int count, SStoozeyPixel pixel) {
+            if (this->encoding == EStoozeyEncoding::RLE) {
+                this->frame.WriteRun(this->stoz, count, pixel);
+                return;
+            }
+
+            if (count < this->min_repeat) {
+                this->literals.insert(this->literals.end(), count, pixel);
+                return;
             }
-            count++;
+
+            this->Flush();
+            this->stoz.uleb128((count - 1) << 1);
+            this->frame.WritePixel(this->stoz, pixel);
         }
-    }
 
-    if (count != 0) write_block();
+        void Flush() {
+            if (this->literals.empty()) return;
 
-    stoz.str("IME");
+            this->stoz.uleb128((((unsigned int) this->literals.size() - 1) << 1) | 1);
+            for (auto& pixel : this->literals)
+                this->frame.WritePixel(this->stoz, pixel);
+            this->literals.clear();
+        }
+    private:
+        SStoozeyFrame& frame;
+        SStoozeySaveVector& stoz;
+        EStoozeyEncoding encoding;
+
+        unsigned int min_repeat;
+        std::vector<SStoozeyPixel> literals;
+};
+
+enum class EStoozeyRowFilter : uint8_t {
+    NONE,
+    SUB,
+    UP,
+    PAETH
+};
+
+static uint8_t Paeth(uint8_t a, uint8_t b, uint8_t c) {
+    int pa = std::abs(b - c);
+    int pb = std::abs(a - c);
+    int pc = std::abs(a + b - c - c);
+    if (pa <= pb && pa <= pc) return a;
+    if (pb <= pc) return b;
+    return c;
 }
 
-std::vector<uint8_t> SStoz::Pack() {
-    SStoozeySaveVector stoz(0x100);
-    SStoozeySaveVector image_vector((this->GetWidth() * this->GetHeight()) * 4);
+// Tries every filter on the row and keeps whichever leaves the smallest
+// residuals, the same minimum sum of absolute differences heuristic PNG uses.
+static EStoozeyRowFilter FilterRow(const uint8_t* row, const uint8_t* prior, uint8_t* out, std::vector<uint8_t>& scratch, size_t length, int bpp) {
+    scratch.resize(length * 3);
+    uint8_t* sub = scratch.data();
+    uint8_t* up = sub + length;
+    uint8_t* paeth = up + length;
+
+    for (size_t i = 0; i < length; ++i) {
+        uint8_t left = i >= (size_t) bpp ? row[i - bpp] : 0;
+        uint8_t upper_left = i >= (size_t) bpp ? prior[i - bpp] : 0;
+        sub[i] = row[i] - left;
+        up[i] = row[i] - prior[i];
+        paeth[i] = row[i] - Paeth(left, prior[i], upper_left);
+    }
 
-    // Magic data
-    stoz.str("STOZ");
-    stoz.u8(0);
+    const uint8_t* candidates[] = { row, sub, up, paeth };
+    EStoozeyRowFilter best = EStoozeyRowFilter::NONE;
+    unsigned int best_sum = UINT_MAX;
+    for (int filter = 0; filter < 4; ++filter) {
+        unsigned int sum = 0;
+        for (size_t i = 0; i < length; ++i)
+            sum += std::abs((int8_t) candidates[filter][i]);
+        if (sum < best_sum) {
+            best_sum = sum;
+            best = (EStoozeyRowFilter) filter;
+        }
+    }
 
-    // Headers
-    stoz.str("HDS");
-    for (auto header : this->headers) {
-        stoz.uleb128((int) header.first);
-        stoz.uleb128(header.second);
+    memcpy(out, candidates[(int) best], length);
+    return best;
+}
+
+// Reverses FilterRow in place. Up is a plain vector add, sub and paeth walk a
+// pixel at a time but do all channels of it at once.
+static void UnfilterRow(EStoozeyRowFilter filter, uint8_t* row, const uint8_t* prior, size_t length, int bpp) {
+    size_t i = 0;
+    switch (filter) {
+        case EStoozeyRowFilter::NONE:
+            break;
+        case EStoozeyRowFilter::UP:
+#if defined(__SSSE3__)
+            for (; i + 16 <= length; i += 16) {
+                __m128i value = _mm_loadu_si128((const __m128i*) (row + i));
+                __m128i above = _mm_loadu_si128((const __m128i*) (prior + i));
+                _mm_storeu_si128((__m128i*) (row + i), _mm_add_epi8(value, above));
+            }
+#endif
+            for (; i < length; ++i)
+                row[i] += prior[i];
+            break;
+        case EStoozeyRowFilter::SUB:
+#if defined(__SSSE3__)
+            if (bpp == 4) {
+                __m128i left = _mm_setzero_si128();
+                for (; i + 4 <= length; i += 4) {
+                    uint32_t value;
+                    memcpy(&value, row + i, 4);
+                    left = _mm_add_epi8(left, _mm_cvtsi32_si128((int) value));
+                    value = (uint32_t) _mm_cvtsi128_si32(left);
+                    memcpy(row + i, &value, 4);
+                }
+                break;
+            }
+#endif
+            for (i = bpp; i < length; ++i)
+                row[i] += row[i - bpp];
+            break;
+        case EStoozeyRowFilter::PAETH:
+#if defined(__SSSE3__)
+            if (bpp == 3 || bpp == 4) {
+                // Widened to 16 bits so the predictor distances can't overflow.
+                const __m128i zero = _mm_setzero_si128();
+                __m128i a = zero, c = zero;
+                for (; i + bpp <= length; i += bpp) {
+                    uint32_t above = 0, value = 0;
+                    memcpy(&above, prior + i, bpp);
+                    memcpy(&value, row + i, bpp);
+                    __m128i b = _mm_unpacklo_epi8(_mm_cvtsi32_si128((int) above), zero);
+                    __m128i d = _mm_unpacklo_epi8(_mm_cvtsi32_si128((int) value), zero);
+
+                    __m128i pa = _mm_sub_epi16(b, c);
+                    __m128i pb = _mm_sub_epi16(a, c);
+                    __m128i pc = _mm_abs_epi16(_mm_add_epi16(pa, pb));
+                    pa = _mm_abs_epi16(pa);
+                    pb = _mm_abs_epi16(pb);
+                    __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+
+                    __m128i use_a = _mm_cmpeq_epi16(smallest, pa);
+                    __m128i use_b = _mm_andnot_si128(use_a, _mm_cmpeq_epi16(smallest, pb));
+                    __m128i use_c = _mm_andnot_si128(_mm_or_si128(use_a, use_b), _mm_set1_epi16(-1));
+                    __m128i nearest = _mm_or_si128(_mm_or_si128(_mm_and_si128(use_a, a), _mm_and_si128(use_b, b)), _mm_and_si128(use_c, c));
+
+                    d = _mm_and_si128(_mm_add_epi16(d, nearest), _mm_set1_epi16(0xFF));
+                    value = (uint32_t) _mm_cvtsi128_si32(_mm_packus_epi16(d, zero));
+                    memcpy(row + i, &value, bpp);
+
+                    a = d;
+                    c = b;
+                }
+                break;
+            }
+#endif
+            for (; i < length; ++i) {
+                uint8_t left = i >= (size_t) bpp ? row[i - bpp] : 0;
+                uint8_t upper_left = i >= (size_t) bpp ? prior[i - bpp] : 0;
+                row[i] += Paeth(left, prior[i], upper_left);
+            }
+            break;
+        default:
+            throw std::runtime_error("Unknown row filter!");
     }
-    stoz.str("HDE");
+}
 
-    // Image data
-    for (auto& frame : this->frames)
-        frame.Pack(image_vector);
+static int GetBytesPerCell(EStoozeyImageMode image_mode) {
+    switch (image_mode) {
+        case EStoozeyImageMode::RGBA: return 4;
+        case EStoozeyImageMode::RGB: return 3;
+        default: return 1;
+    }
+}
 
-    // Zlib compress data
+void SStoozeyFrame::PackRows(SStoozeySaveVector& stoz, int rect_x, int rect_y, int rect_width, int rect_height) {
+    if (this->image_mode == EStoozeyImageMode::INDEXED && this->palette == nullptr)
+        throw std::runtime_error("Indexed frame doesn't have a palette!");
+
+    int bpp = GetBytesPerCell(this->image_mode);
+    size_t length = (size_t) rect_width * bpp;
+    std::vector<uint8_t> current(length), prior(length, 0), filtered(length), scratch;
+
+    for (int y = rect_y; y < rect_y + rect_height; ++y) {
+        const SStoozeyPixel* row = (*this->grid)[y].data() + rect_x;
+        uint8_t* out = current.data();
+        switch (this->image_mode) {
+            case EStoozeyImageMode::RGBA:
+                memcpy(out, row, length);
+                break;
+            case EStoozeyImageMode::RGB:
+                for (int x = 0; x < rect_width; ++x) {
+                    out[x * 3] = row[x].r;
+                    out[x * 3 + 1] = row[x].g;
+                    out[x * 3 + 2] = row[x].b;
+                }
+                break;
+            case EStoozeyImageMode::INDEXED:
+                for (int x = 0; x < rect_width; ++x)
+                    out[x] = this->palette->GetIndex(row[x]);
+                break;
+            default:
+                for (int x = 0; x < rect_width; ++x)
+                    out[x] = row[x].r;
+                break;
+        }
 
-    image_vector.Compress();
-    std::vector<uint8_t> compressed_data = image_vector.GetData();
-    std::vector<uint8_t> stoz_data = stoz.GetData();
-    stoz_data.insert(stoz_data.end(), compressed_data.begin(), compressed_data.end());
+        EStoozeyRowFilter filter = FilterRow(current.data(), prior.data(), filtered.data(), scratch, length, bpp);
+        stoz.u8((uint8_t) filter);
+        stoz.bytes(filtered.data(), length);
+        std::swap(current, prior);
+    }
+}
 
-    return stoz_data;
+void SStoozeyFrame::UnpackRows(SStoozeyLoadVector& stoz, int rect_x, int rect_y, int rect_width, int rect_height) {
+    std::span<const SStoozeyPixel> colors = this->GetPaletteColors();
+    int bpp = GetBytesPerCell(this->image_mode);
+    size_t length = (size_t) rect_width * bpp;
+    std::vector<uint8_t> current(length), prior(length, 0);
+
+    for (int y = rect_y; y < rect_y + rect_height; ++y) {
+        if (stoz.GetRemaining() < length + 1)
+            throw std::runtime_error("Filtered row is truncated!");
+        EStoozeyRowFilter filter = (EStoozeyRowFilter) stoz.u8();
+        memcpy(current.data(), stoz.GetPointer(), length);
+        stoz.Forward((unsigned int) length);
+        UnfilterRow(filter, current.data(), prior.data(), length, bpp);
+
+        SStoozeyPixel* row = this->GetMutableGrid().GetMutableRow(y).data() + rect_x;
+        const uint8_t* in = current.data();
+        switch (this->image_mode) {
+            case EStoozeyImageMode::RGBA:
+                memcpy(row, in, length);
+                break;
+            case EStoozeyImageMode::RGB:
+                for (int x = 0; x < rect_width; ++x)
+                    row[x] = { .r = in[x * 3], .g = in[x * 3 + 1], .b = in[x * 3 + 2], .a = 0xFF };
+                break;
+            case EStoozeyImageMode::INDEXED:
+                for (int x = 0; x < rect_width; ++x) {
+                    if (colors.empty()) row[x] = { .r = in[x] };
+                    else if (in[x] < colors.size()) row[x] = colors[in[x]];
+                    else throw std::runtime_error("Palette index is out of range!");
+                }
+                break;
+            default:
+                for (int x = 0; x < rect_width; ++x)
+                    row[x] = { .r = in[x], .g = in[x], .b = in[x] };
+                break;
+        }
+        std::swap(current, prior);
+    }
 }
 
-SStoozeyFrame::SStoozeyFrame(SStoozeyHeader header) {
-    this->image_mode = header.image_mode;
-    this->image_width = header.width;
-    this->image_height = header.height;
-    this->pixel_size = header.pixel_size;
+// Position of the d-th cell along a Hilbert curve filling a size x size square.
+static std::tuple<int, int> GetHilbertPosition(int size, int d) {
+    int x = 0, y = 0;
+    for (int s = 1; s < size; s *= 2) {
+        int rx = 1 & (d / 2);
+        int ry = 1 & (d ^ rx);
+        if (ry == 0) {
+            if (rx == 1) {
+                x = s - 1 - x;
+                y = s - 1 - y;
+            }
+            std::swap(x, y);
+        }
+        x += s * rx;
+        y += s * ry;
+        d /= 4;
+    }
+    return { x, y };
+}
+
+// Cell indices (y * grid_width + x) in the order a scan visits them. Tables are
+// cached per order and grid size, so every frame of an image, and every image
+// of the same size, walks the same one.
+static std::shared_ptr<const std::vector<unsigned int>> GetScanTable(EStoozeyScanOrder scan_order, int grid_width, int grid_height) {
+    static std::mutex cache_mutex;
+    static std::unordered_map<uint64_t, std::shared_ptr<const std::vector<unsigned int>>> cache;
+
+    uint64_t key = ((uint64_t) scan_order << 56) ^ ((uint64_t) grid_width << 28) ^ (uint64_t) grid_height;
+    {
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        auto found = cache.find(key);
+        if (found != cache.end()) return found->second;
+    }
+
+    auto table = std::make_shared<std::vector<unsigned int>>();
+    table->reserve((size_t) grid_width * grid_height);
+
+    if (scan_order == EStoozeyScanOrder::ROW || scan_order == EStoozeyScanOrder::COLUMN) {
+        bool by_row = scan_order == EStoozeyScanOrder::ROW;
+        int outer = by_row ? grid_height : grid_width;
+        int inner = by_row ? grid_width : grid_height;
+        for (int i = 0; i < outer; ++i)
+            for (int j = 0; j < inner; ++j)
+                table->push_back(by_row ? (i * grid_width + j) : (j * grid_width + i));
+    }
+    else if (scan_order == EStoozeyScanOrder::ZORDER || scan_order == EStoozeyScanOrder::HILBERT) {
+        // The curve is laid out once for a tile, then repeated across the grid.
+        // A Hilbert tile ends next to where the tile to its right begins.
+        const int tile_size = 16;
+        std::vector<std::tuple<int, int>> tile;
+        for (int d = 0; d < tile_size * tile_size; ++d) {
+            if (scan_order == EStoozeyScanOrder::HILBERT) {
+                tile.push_back(GetHilbertPosition(tile_size, d));
+                continue;
+            }
 
-    this->grid_width = (int) std::ceil(header.width / header.pixel_size);
-    this->grid_height = (int) std::ceil(header.height / header.pixel_size);
+            int x = 0, y = 0;
+            for (int bit = 0; bit < 4; ++bit) {
+                x |= ((d >> (bit * 2)) & 1) << bit;
+                y |= ((d >> (bit * 2 + 1)) & 1) << bit;
+            }
+            tile.push_back({ x, y });
+        }
 
-    this->grid = SStoozeyGrid();
-    this->grid.reserve(this->grid_height);
+        for (int tile_y = 0; tile_y < grid_height; tile_y += tile_size) {
+            for (int tile_x = 0; tile_x < grid_width; tile_x += tile_size) {
+                for (auto [x, y] : tile) {
+                    x += tile_x;
+                    y += tile_y;
+                    if (x < grid_width && y < grid_height)
+                        table->push_back(y * grid_width + x);
+                }
+            }
+        }
+    }
+    else throw std::runtime_error("Unknown scan order!");
 
-    for (int i = 0; i < this->grid_height; ++i)
-        this->grid.push_back(std::vector<SStoozeyPixel>(this->grid_width));
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    if (cache.size() >= 16) cache.clear();
+    cache[key] = table;
+    return table;
 }
 
-std::tuple<int, int> SStoozeyFrame::GetCellPosition(int x, int y) {
-    return {
-        std::max((int) 0, (int) std::min(this->grid_width - 1, (int) std::floor(x / this->pixel_size))),
-        std::max((int) 0, (int) std::min(this->grid_height - 1, (int) std::floor(y / this->pixel_size)))
-    };
+// Planes a mode is stored as, alpha first so mask readers can stop after it.
+static std::vector<int> GetPlaneChannels(EStoozeyImageMode image_mode) {
+    switch (image_mode) {
+        case EStoozeyImageMode::RGBA: return { 3, 0, 1, 2 };
+        case EStoozeyImageMode::RGB: return { 0, 1, 2 };
+        default: return { 0 };
+    }
 }
 
-SStoozeyPixel SStoozeyFrame::GetPixel(int x, int y) {
-    auto grid_position = this->GetCellPosition(x, y);
-    auto [grid_x, grid_y] = grid_position;
-    return this->grid[grid_y][grid_x];
+// Weaves separate channel planes back into pixels, 16 at a time with SSE.
+static void InterleavePlanes(const uint8_t* r, const uint8_t* g, const uint8_t* b, const uint8_t* a, SStoozeyPixel* out, int count) {
+    int x = 0;
+#if defined(__SSSE3__)
+    for (; x + 16 <= count; x += 16) {
+        __m128i red = _mm_loadu_si128((const __m128i*) (r + x));
+        __m128i green = _mm_loadu_si128((const __m128i*) (g + x));
+        __m128i blue = _mm_loadu_si128((const __m128i*) (b + x));
+        __m128i alpha = _mm_loadu_si128((const __m128i*) (a + x));
+
+        __m128i rg_low = _mm_unpacklo_epi8(red, green);
+        __m128i rg_high = _mm_unpackhi_epi8(red, green);
+        __m128i ba_low = _mm_unpacklo_epi8(blue, alpha);
+        __m128i ba_high = _mm_unpackhi_epi8(blue, alpha);
+
+        __m128i* dst = (__m128i*) (out + x);
+        _mm_storeu_si128(dst, _mm_unpacklo_epi16(rg_low, ba_low));
+        _mm_storeu_si128(dst + 1, _mm_unpackhi_epi16(rg_low, ba_low));
+        _mm_storeu_si128(dst + 2, _mm_unpacklo_epi16(rg_high, ba_high));
+        _mm_storeu_si128(dst + 3, _mm_unpackhi_epi16(rg_high, ba_high));
+    }
+#endif
+    for (; x < count; ++x)
+        out[x] = { .r = r[x], .g = g[x], .b = b[x], .a = a[x] };
 }
 
-void SStoozeyFrame::SetPixel(int x, int y, SStoozeyPixel pixel) {
-    auto grid_position = this->GetCellPosition(x, y);
-    auto [grid_x, grid_y] = grid_position;
-    this->grid[grid_y][grid_x] = pixel;
+void SStoozeyFrame::PackPlanes(SStoozeySaveVector& stoz, int rect_x, int rect_y, int rect_width, int rect_height) {
+    if (this->image_mode == EStoozeyImageMode::INDEXED && this->palette == nullptr)
+        throw std::runtime_error("Indexed frame doesn't have a palette!");
+
+    std::vector<uint8_t> plane((size_t) rect_width * rect_height);
+    for (int channel : GetPlaneChannels(this->image_mode)) {
+        uint8_t* out = plane.data();
+        for (int y = rect_y; y < rect_y + rect_height; ++y) {
+            const SStoozeyPixel* row = (*this->grid)[y].data() + rect_x;
+            if (this->image_mode == EStoozeyImageMode::INDEXED) {
+                for (int x = 0; x < rect_width; ++x)
+                    *out++ = this->palette->GetIndex(row[x]);
+            }
+            else {
+                for (int x = 0; x < rect_width; ++x)
+                    *out++ = ((const uint8_t*) &row[x])[channel];
+            }
+        }
+
+        // Each plane is prefixed with its size, so readers can skip it.
+        SStoozeySaveVector runs(0x100);
+        for (size_t i = 0; i < plane.size();) {
+            size_t end = i + 1;
+            while (end < plane.size() && plane[end] == plane[i]) ++end;
+            runs.uleb128((unsigned int) (end - i));
+            runs.u8(plane[i]);
+            i = end;
+        }
+
+        std::vector<uint8_t> data = runs.GetData();
+        stoz.uleb128((unsigned int) data.size());
+        stoz.bytes(data.data(), data.size());
+    }
 }
 
-std::shared_ptr<SStoz> SStoz::Load(const char* filename) {
-    SStoozeyLoadVector load_vector(filename);
+void SStoozeyFrame::UnpackPlanes(SStoozeyLoadVector& stoz, int rect_x, int rect_y, int rect_width, int rect_height, bool alpha_only) {
+    size_t cell_count = (size_t) rect_width * rect_height;
+    std::vector<int> channels = GetPlaneChannels(this->image_mode);
+
+    // Channels the mode doesn't store are filled in as they'd be after a normal load.
+    std::vector<uint8_t> planes[4];
+    planes[3].assign(cell_count, 0xFF);
+
+    for (int channel : channels) {
+        unsigned int size = stoz.uleb128();
+        if (stoz.GetRemaining() < size)
+            throw std::runtime_error("Plane is truncated!");
+        // Indexed alpha lives in the palette, so the index plane is always needed.
+        if (alpha_only && channel != 3 && this->image_mode != EStoozeyImageMode::INDEXED) {
+            stoz.Forward(size);
+            continue;
+        }
 
-    if (load_vector.str(4) != "STOZ")
-        throw std::runtime_error("File supplied isn't a STOZ file!");
-    load_vector.u8();
-    if (load_vector.str(3) != "HDS")
-        throw std::runtime_error("Expected header start!");
+        size_t end = stoz.GetRemaining() - size;
+        std::vector<uint8_t>& plane = planes[channel];
+        plane.resize(cell_count);
+        size_t cell = 0;
+        while (cell < cell_count && stoz.GetRemaining() > end) {
+            unsigned int count = stoz.uleb128();
+            uint8_t value = stoz.u8();
+            count = (unsigned int) std::min<size_t>(count, cell_count - cell);
+            memset(plane.data() + cell, value, count);
+            cell += count;
+        }
+        if (cell != cell_count || stoz.GetRemaining() != end)
+            throw std::runtime_error("Plane doesn't cover the frame!");
+    }
 
-    SStoozeyHeader header;
-    // This surely isn't a problematic way to do this.
-    while (strncmp((const char*)load_vector.GetPointer(), "HDE", 3) != 0) {
-        unsigned int* ptr = ((unsigned int*)&header) + (load_vector.uleb128());
-        *ptr = load_vector.uleb128();
+    for (int channel = 0; channel < 3; ++channel) {
+        if (!planes[channel].empty()) continue;
+        // L spreads its one plane over the color channels, alpha masks leave them black.
+        if (this->image_mode == EStoozeyImageMode::L && !alpha_only) planes[channel] = planes[0];
+        else planes[channel].assign(cell_count, 0);
     }
-    load_vector.str(3);
 
-    // Over-estimate of size since format doesn't store uncompressed size
-    unsigned int uncompressed_size = (header.width * header.height) * 0x8;
-    load_vector.Decompress(uncompressed_size);
+    std::span<const SStoozeyPixel> colors = this->GetPaletteColors();
+    for (int y = 0; y < rect_height; ++y) {
+        SStoozeyPixel* row = this->GetMutableGrid().GetMutableRow(rect_y + y).data() + rect_x;
+        size_t offset = (size_t) y * rect_width;
+
+        if (this->image_mode == EStoozeyImageMode::INDEXED && !colors.empty()) {
+            const uint8_t* in = planes[0].data() + offset;
+            for (int x = 0; x < rect_width; ++x) {
+                if (in[x] >= colors.size())
+                    throw std::runtime_error("Palette index is out of range!");
+                row[x] = colors[in[x]];
+            }
+            continue;
+        }
 
-    auto stoz = std::make_shared<SStoz>(header);
-    for (int i = 0; i < header.frame_count; ++i) {
-        SStoozeyFrame& frame = stoz->frames[i];
-        if (load_vector.str(3) != "IMS")
-            throw std::runtime_error("Expected frame start!");
+        InterleavePlanes(planes[0].data() + offset, planes[1].data() + offset, planes[2].data() + offset, planes[3].data() + offset, row, rect_width);
+    }
+}
+
+// QOI opcodes. The two bit ones carry their payload in the low six bits.
+enum : uint8_t {
+    QOI_OP_INDEX = 0x00,
+    QOI_OP_DIFF = 0x40,
+    QOI_OP_LUMA = 0x80,
+    QOI_OP_RUN = 0xC0,
+    QOI_OP_RGB = 0xFE,
+    QOI_OP_RGBA = 0xFF,
+};
+
+static int GetQOIHash(SStoozeyPixel pixel) {
+    return (pixel.r * 3 + pixel.g * 5 + pixel.b * 7 + pixel.a * 11) & 63;
+}
+
+void SStoozeyFrame::PackQOI(SStoozeySaveVector& stoz, int rect_x, int rect_y, int rect_width, int rect_height) {
+    // Worst case every cell takes an RGBA opcode, so write straight into a
+    // buffer that big rather than pushing byte by byte.
+    std::vector<uint8_t> buffer((size_t) rect_width * rect_height * 5);
+    uint8_t* out = buffer.data();
+
+    SStoozeyPixel cache[64] = {};
+    SStoozeyPixel previous = { .a = 0xFF };
+    int run = 0;
+
+    for (int y = rect_y; y < rect_y + rect_height; ++y) {
+        const SStoozeyPixel* row = (*this->grid)[y].data() + rect_x;
+        for (int x = 0; x < rect_width; ++x) {
+            SStoozeyPixel pixel = row[x];
+            if (*((uint32_t*)&pixel) == *((uint32_t*)&previous)) {
+                if (++run == 62) {
+                    *out++ = QOI_OP_RUN | (run - 1);
+                    run = 0;
+                }
+                continue;
+            }
 
-        int grid_size = frame.GetGridHeight() * frame.GetGridHeight();
-        int grid_index = 0;
-        while (grid_index < grid_size) {
-            int count = load_vector.uleb128();
+            if (run > 0) {
+                *out++ = QOI_OP_RUN | (run - 1);
+                run = 0;
+            }
 
-            SStoozeyPixel pixel;
-            if (header.image_mode == EStoozeyImageMode::RGBA) {
-                pixel = *(SStoozeyPixel*)(load_vector.GetPointer());
-                load_vector.Forward(4);
+            int hash = GetQOIHash(pixel);
+            if (*((uint32_t*)&cache[hash]) == *((uint32_t*)&pixel)) {
+                *out++ = QOI_OP_INDEX | hash;
             }
-            else if (header.image_mode == EStoozeyImageMode::RGB) {
-                pixel = {
-                    .r = load_vector.u8(),
-                    .g = load_vector.u8(),
-                    .b = load_vector.u8(),
-                    .a = 0xFF
-                };
+            else {
+                cache[hash] = pixel;
+
+                if (pixel.a == previous.a) {
+                    int8_t dr = pixel.r - previous.r;
+                    int8_t dg = pixel.g - previous.g;
+                    int8_t db = pixel.b - previous.b;
+                    int8_t dr_dg = dr - dg;
+                    int8_t db_dg = db - dg;
+
+                    if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+                        *out++ = QOI_OP_DIFF | ((dr + 2) << 4) | ((dg + 2) << 2) | (db + 2);
+                    }
+                    else if (dr_dg >= -8 && dr_dg <= 7 && dg >= -32 && dg <= 31 && db_dg >= -8 && db_dg <= 7) {
+                        *out++ = QOI_OP_LUMA | (dg + 32);
+                        *out++ = ((dr_dg + 8) << 4) | (db_dg + 8);
+                    }
+                    else {
+                        *out++ = QOI_OP_RGB;
+                        *out++ = pixel.r;
+                        *out++ = pixel.g;
+                        *out++ = pixel.b;
+                    }
+                }
+                else {
+                    *out++ = QOI_OP_RGBA;
+                    *out++ = pixel.r;
+                    *out++ = pixel.g;
+                    *out++ = pixel.b;
+                    *out++ = pixel.a;
+                }
             }
-            else pixel = { .r = load_vector.u8() };
 
-            for (int j = 0; j < count; ++j, ++grid_index) {
-                int x = grid_index % frame.GetGridHeight();
-                int y = (int) std::floor(grid_index / frame.GetGridWidth());
+            previous = pixel;
+        }
+    }
+
+    if (run > 0)
+        *out++ = QOI_OP_RUN | (run - 1);
+
+    stoz.bytes(buffer.data(), out - buffer.data());
+}
+
+void SStoozeyFrame::UnpackQOI(SStoozeyLoadVector& stoz, int rect_x, int rect_y, int rect_width, int rect_height) {
+    const uint8_t* in = stoz.GetPointer();
+    const uint8_t* end = in + stoz.GetRemaining();
+
+    SStoozeyPixel cache[64] = {};
+    SStoozeyPixel pixel = { .a = 0xFF };
+    int run = 0;
+
+    for (int y = rect_y; y < rect_y + rect_height; ++y) {
+        SStoozeyPixel* row = this->GetMutableGrid().GetMutableRow(y).data() + rect_x;
+        for (int x = 0; x < rect_width; ++x) {
+            if (run > 0) {
+                run--;
+                row[x] = pixel;
+                continue;
+            }
 
-                frame.SetPixel(x, y, pixel);
+            if (in == end)
+                throw std::runtime_error("Image data is truncated!");
+            uint8_t op = *in++;
+            int payload = (op == QOI_OP_RGBA) ? 4 : (op == QOI_OP_RGB) ? 3 : ((op & 0xC0) == QOI_OP_LUMA) ? 1 : 0;
+            if (end - in < payload)
+                throw std::runtime_error("Image data is truncated!");
+
+            if (op == QOI_OP_RGB) {
+                pixel.r = in[0];
+                pixel.g = in[1];
+                pixel.b = in[2];
+                in += 3;
+            }
+            else if (op == QOI_OP_RGBA) {
+                pixel = { .r = in[0], .g = in[1], .b = in[2], .a = in[3] };
+                in += 4;
+            }
+            else if ((op & 0xC0) == QOI_OP_INDEX) {
+                pixel = cache[op];
+            }
+            else if ((op & 0xC0) == QOI_OP_DIFF) {
+                pixel.r += ((op >> 4) & 3) - 2;
+                pixel.g += ((op >> 2) & 3) - 2;
+                pixel.b += (op & 3) - 2;
             }
+            else if ((op & 0xC0) == QOI_OP_LUMA) {
+                int dg = (op & 63) - 32;
+                uint8_t next = *in++;
+                pixel.r += dg - 8 + ((next >> 4) & 15);
+                pixel.g += dg;
+                pixel.b += dg - 8 + (next & 15);
+            }
+            else {
+                run = op & 63;
+            }
+
+            cache[GetQOIHash(pixel)] = pixel;
+            row[x] = pixel;
         }
+    }
 
-        if (load_vector.str(3) != "IME")
-            throw std::runtime_error("Expected frame end!");
+    if (run > 0)
+        throw std::runtime_error("Run goes past the end of the frame!");
+
+    stoz.Forward((unsigned int) (in - stoz.GetPointer()));
+
+    // Every color must be in the palette, same as for the other encodings.
+    std::span<const SStoozeyPixel> colors = this->GetPaletteColors();
+    if (!colors.empty()) {
+        for (int y = rect_y; y < rect_y + rect_height; ++y) {
+            const SStoozeyPixel* row = (*this->grid)[y].data() + rect_x;
+            for (int x = 0; x < rect_width; ++x)
+                if (!this->palette->indices.contains(*((uint32_t*)&row[x])))
+                    throw std::runtime_error("Palette index is out of range!");
+        }
     }
+}
 
-    return stoz;
+void SStoozeyFrame::Pack(SStoozeySaveVector& stoz, EStoozeyEncoding encoding, EStoozeyScanOrder scan_order) {
+    stoz.str("IMS");
+
+    if (encoding == EStoozeyEncoding::FILTERED) {
+        this->PackRows(stoz, 0, 0, this->grid_width, this->grid_height);
+        stoz.str("IME");
+        return;
+    }
+
+    if (encoding == EStoozeyEncoding::PLANAR) {
+        this->PackPlanes(stoz, 0, 0, this->grid_width, this->grid_height);
+        stoz.str("IME");
+        return;
+    }
+
+    if (encoding == EStoozeyEncoding::QOI) {
+        this->PackQOI(stoz, 0, 0, this->grid_width, this->grid_height);
+        stoz.str("IME");
+        return;
+    }
+
+    SStoozeyRunWriter writer(*this, stoz, encoding);
+    if (scan_order == EStoozeyScanOrder::ROW) {
+        for (const SStoozeyRunLength& run : this->Runs())
+            writer.Add(run.count, run.pixel);
+    }
+    else {
+        auto table = GetScanTable(scan_order, this->grid_width, this->grid_height);
+        const SStoozeyGrid& grid = *this->grid;
+
+        SStoozeyPixel pixel;
+        unsigned int count = 0;
+        for (unsigned int cell : *table) {
+            const SStoozeyPixel& current = grid[cell / this->grid_width][cell % this->grid_width];
+            if (count != 0 && *((uint32_t*)&current) == *((uint32_t*)&pixel)) {
+                count++;
+                continue;
+            }
+
+            if (count != 0) writer.Add(count, pixel);
+            pixel = current;
+            count = 1;
+        }
+        if (count != 0) writer.Add(count, pixel);
+    }
+    writer.Flush();
+
+    stoz.str("IME");
 }
 
-std::shared_ptr<SStoz> SStoz::FromImage(const char* filename) {
-    int width, height, channels;
-    unsigned char* image = stbi_load(filename, &width, &height, &channels, 0);
+std::tuple<int, int, int, int> SStoozeyFrame::GetDirtyRect(SStoozeyFrame& previous) {
+    int min_x = this->grid_width, max_x = -1;
+    int min_y = this->grid_height, max_y = -1;
 
-    if (image == nullptr)
-        throw std::runtime_error("Image failed to load!");
+    for (int y = 0; y < this->grid_height; ++y) {
+        const uint32_t* row = (const uint32_t*) (*this->grid)[y].data();
+        const uint32_t* previous_row = (const uint32_t*) (*previous.grid)[y].data();
+
+        int first = 0, last = this->grid_width - 1;
+        while (first <= last && row[first] == previous_row[first]) ++first;
+        if (first > last) continue;
+        while (row[last] == previous_row[last]) --last;
+
+        min_x = std::min(min_x, first);
+        max_x = std::max(max_x, last);
+        min_y = std::min(min_y, y);
+        max_y = y;
+    }
 
-    SStoozeyHeader header {
-        .image_mode = ((channels > 3) ? EStoozeyImageMode::RGBA : EStoozeyImageMode::RGB),
-        .width = width,
-        .height = height,
-    };
+    if (max_x < 0) return { 0, 0, 0, 0 };
+    return { min_x, min_y, (max_x - min_x) + 1, (max_y - min_y) + 1 };
+}
 
-    auto stoz = std::make_shared<SStoz>(header);
-    SStoozeyFrame& frame = stoz->frames[0];
-    for (int x = 0; x < width; ++x) {
-        for (int y = 0; y < height; ++y) {
-            unsigned char* pixel_pos = (image + (((y * width) + x) * channels));
-
-            SStoozeyPixel pixel = {
-                .r = *((uint8_t*)(pixel_pos)),
-                .g = *((uint8_t*)(pixel_pos + 1)),
-                .b = *((uint8_t*)(pixel_pos + 2)),
-                .a = (uint8_t) ((channels > 3) ? (*((uint8_t*)(pixel_pos + 3))) : (0xFF)),
-            };
+uint64_t SStoozeyFrame::Hash() {
+    // Eight independent multiply-xor lanes, which the compiler can keep in a
+    // single vector register, folded together at the end.
+    constexpr int lane_count = 8;
+    uint32_t lanes[lane_count];
+    for (int i = 0; i < lane_count; ++i)
+        lanes[i] = 0x811C9DC5u + i;
+
+    for (int y = 0; y < this->grid_height; ++y) {
+        const uint32_t* row = (const uint32_t*) (*this->grid)[y].data();
 
-            frame.SetPixel(x, y, pixel);
+        int x = 0;
+        for (; x + lane_count <= this->grid_width; x += lane_count) {
+            for (int i = 0; i < lane_count; ++i)
+                lanes[i] = (lanes[i] ^ row[x + i]) * 0x9E3779B1u;
         }
+
+        for (; x < this->grid_width; ++x)
+            lanes[x % lane_count] = (lanes[x % lane_count] ^ row[x]) * 0x85EBCA77u;
     }
-    
-    stbi_image_free(image);
 
-    return stoz;
+    uint64_t hash = 0xCBF29CE484222325ull;
+    for (int i = 0; i < lane_count; ++i) {
+        hash ^= lanes[i];
+        hash *= 0x100000001B3ull;
+        hash ^= hash >> 29;
+    }
+
+    return hash;
+}
+
+bool SStoozeyFrame::IsIdentical(SStoozeyFrame& other) {
+    if (this->grid_width != other.grid_width || this->grid_height != other.grid_height)
+        return false;
+    if (this->grid == other.grid)
+        return true;
+
+    for (int y = 0; y < this->grid_height; ++y) {
+        if (memcmp((*this->grid)[y].data(), (*other.grid)[y].data(), this->grid_width * sizeof(SStoozeyPixel)) != 0)
+            return false;
+    }
+
+    return true;
+}
+
+void SStoozeyFrame::PackDelta(SStoozeySaveVector& stoz, SStoozeyFrame& previous, EStoozeyEncoding encoding, EStoozeyScanOrder scan_order) {
+    auto [rect_x, rect_y, rect_width, rect_height] = this->GetDirtyRect(previous);
+
+    // A full frame is just as small once the whole grid has changed. It's
+    // decoded in the file's scan order like any other full frame.
+    if (rect_width * rect_height == this->grid_width * this->grid_height) {
+        this->Pack(stoz, encoding, scan_order);
+        return;
+    }
+
+    stoz.str("IMD");
+    stoz.uleb128(rect_x);
+    stoz.uleb128(rect_y);
+    stoz.uleb128(rect_width);
+    stoz.uleb128(rect_height);
+
+    if (encoding == EStoozeyEncoding::FILTERED) {
+        this->PackRows(stoz, rect_x, rect_y, rect_width, rect_height);
+        stoz.str("IME");
+        return;
+    }
+
+    if (encoding == EStoozeyEncoding::PLANAR) {
+        this->PackPlanes(stoz, rect_x, rect_y, rect_width, rect_height);
+        stoz.str("IME");
+        return;
+    }
+
+    if (encoding == EStoozeyEncoding::QOI) {
+        this->PackQOI(stoz, rect_x, rect_y, rect_width, rect_height);
+        stoz.str("IME");
+        return;
+    }
+
+    // Runs cover the rectangle in row-major order, wrapping from one row of it to the next.
+    SStoozeyRunWriter writer(*this, stoz, encoding);
+    SStoozeyPixel pixel;
+    unsigned int count = 0;
+    for (int y = rect_y; y < rect_y + rect_height; ++y) {
+        const SStoozeyPixel* row = (*this->grid)[y].data();
+        for (int x = rect_x; x < rect_x + rect_width; ++x) {
+            if (count != 0 && *((uint32_t*)&row[x]) == *((uint32_t*)&pixel)) {
+                count++;
+                continue;
+            }
+
+            if (count != 0) writer.Add(count, pixel);
+            pixel = row[x];
+            count = 1;
+        }
+    }
+
+    if (count != 0) writer.Add(count, pixel);
+    writer.Flush();
+
+    stoz.str("IME");
+}
+
+static void ParallelFor(int count, const std::function<void(int)>& body);
+
+static std::mutex dictionary_mutex;
+static std::unordered_map<int, std::shared_ptr<const std::vector<uint8_t>>> dictionaries;
+
+// Callers hold on to the dictionary, so re-registering an id mid-pack is harmless.
+static std::shared_ptr<const std::vector<uint8_t>> FindDictionary(int id) {
+    if (id == 0) return std::make_shared<const std::vector<uint8_t>>();
+
+    std::lock_guard<std::mutex> lock(dictionary_mutex);
+    auto found = dictionaries.find(id);
+    if (found == dictionaries.end())
+        throw std::runtime_error("Dictionary isn't registered!");
+    return found->second;
+}
+
+void SStoz::RegisterDictionary(int id, std::vector<uint8_t> dictionary) {
+    if (id == 0)
+        throw std::runtime_error("Dictionary id 0 is reserved!");
+
+    std::lock_guard<std::mutex> lock(dictionary_mutex);
+    dictionaries[id] = std::make_shared<const std::vector<uint8_t>>(std::move(dictionary));
+}
+
+// Deflate through the encoder's stream, or the optimal parser when asked for.
+class SStoozeyZlibCodec : public SStoozeyCodec {
+    public:
+        bool Compress(SStoozeySaveVector& data, const SStoozeyPackOptions& options, SStoozeyEncoder& encoder) override {
+            auto dictionary = FindDictionary(options.dictionary);
+            if (options.optimal_deflate)
+                return data.CompressOptimal(*dictionary, options.optimal_iterations);
+            return encoder.Compress(data, *dictionary, options.compression_level, options.strategy);
+        }
+        void Decompress(SStoozeyLoadVector& data, unsigned int uncompressed_size, const SStoozeyHeader& header, SStoozeyDecoder& decoder) override {
+            decoder.Decompress(data, uncompressed_size, *FindDictionary(header.dictionary));
+        }
+};
+
+class SStoozeyStoreCodec : public SStoozeyCodec {
+    public:
+        bool Compress(SStoozeySaveVector& /*data*/, const SStoozeyPackOptions& /*options*/, SStoozeyEncoder& /*encoder*/) override { return true; }
+        void Decompress(SStoozeyLoadVector& /*data*/, unsigned int /*uncompressed_size*/, const SStoozeyHeader& /*header*/, SStoozeyDecoder& /*decoder*/) override {}
+};
+
+static std::mutex codec_mutex;
+static std::unordered_map<EStoozeyCompression, std::shared_ptr<SStoozeyCodec>> codecs = {
+    { EStoozeyCompression::ZLIB, std::make_shared<SStoozeyZlibCodec>() },
+    { EStoozeyCompression::STORE, std::make_shared<SStoozeyStoreCodec>() },
+};
+
+static std::shared_ptr<SStoozeyCodec> FindCodec(EStoozeyCompression id) {
+    std::lock_guard<std::mutex> lock(codec_mutex);
+    auto found = codecs.find(id);
+    if (found == codecs.end())
+        throw std::runtime_error("Codec isn't registered!");
+    return found->second;
+}
+
+void SStoz::RegisterCodec(EStoozeyCompression id, std::shared_ptr<SStoozeyCodec> codec) {
+    if (id == EStoozeyCompression::ZLIB || id == EStoozeyCompression::STORE)
+        throw std::runtime_error("Codec id is reserved!");
+    if (codec == nullptr)
+        throw std::runtime_error("Codec can't be null!");
+
+    std::lock_guard<std::mutex> lock(codec_mutex);
+    codecs[id] = std::move(codec);
+}
+
+std::vector<uint8_t> SStoz::TrainDictionary(std::span<const std::string> filenames, size_t size) {
+    // Deflate can't look back further than its window.
+    size = std::min<size_t>(size, 0x8000);
+    const int gram_size = 8;
+    const size_t segment_size = 64;
+
+    // The inflated image data of every file, headers are already small.
+    std::vector<std::vector<uint8_t>> samples;
+    for (const std::string& filename : filenames) {
+        SStoozeyLoadVector load_vector(filename.c_str());
+        SStoz::Open(load_vector);
+        samples.emplace_back(load_vector.GetPointer(), load_vector.GetPointer() + load_vector.GetRemaining());
+    }
+
+    auto hash_gram = [](const uint8_t* data) {
+        uint64_t value;
+        memcpy(&value, data, sizeof(value));
+        return value * 0x9E3779B97F4A7C15ull;
+    };
+
+    // How many files each 8 byte string shows up in.
+    std::unordered_map<uint64_t, unsigned int> frequencies;
+    for (const auto& sample : samples) {
+        std::unordered_set<uint64_t> seen;
+        for (size_t i = 0; i + gram_size <= sample.size(); ++i) {
+            uint64_t gram = hash_gram(sample.data() + i);
+            if (seen.insert(gram).second) frequencies[gram]++;
+        }
+    }
+
+    // Segments score by how common their strings are. Strings seen in a single
+    // file don't help any other file.
+    struct SSegment {
+        const uint8_t* data;
+        size_t size;
+        uint64_t score;
+    };
+    std::vector<SSegment> segments;
+    for (const auto& sample : samples) {
+        for (size_t start = 0; start < sample.size(); start += segment_size) {
+            SSegment segment = { .data = sample.data() + start, .size = std::min(segment_size, sample.size() - start), .score = 0 };
+            for (size_t i = 0; i + gram_size <= segment.size; ++i) {
+                unsigned int frequency = frequencies[hash_gram(segment.data + i)];
+                if (frequency > 1) segment.score += frequency;
+            }
+            if (segment.score > 0) segments.push_back(segment);
+        }
+    }
+    std::sort(segments.begin(), segments.end(), [](const SSegment& a, const SSegment& b) { return a.score > b.score; });
+
+    // Take the best segments, skipping ones mostly covered by what's already in.
+    std::vector<const SSegment*> chosen;
+    std::unordered_set<uint64_t> covered;
+    size_t total = 0;
+    for (const SSegment& segment : segments) {
+        if (total + segment.size > size) continue;
+
+        size_t grams = 0, repeats = 0;
+        for (size_t i = 0; i + gram_size <= segment.size; ++i, ++grams)
+            if (covered.contains(hash_gram(segment.data + i))) repeats++;
+        if (repeats * 2 > grams) continue;
+
+        for (size_t i = 0; i + gram_size <= segment.size; ++i)
+            covered.insert(hash_gram(segment.data + i));
+        chosen.push_back(&segment);
+        total += segment.size;
+        if (total == size) break;
+    }
+
+    // Deflate reaches the end of the dictionary with the shortest distances,
+    // so the best segments go last.
+    std::vector<uint8_t> dictionary;
+    dictionary.reserve(total);
+    for (auto segment = chosen.rbegin(); segment != chosen.rend(); ++segment)
+        dictionary.insert(dictionary.end(), (*segment)->data, (*segment)->data + (*segment)->size);
+
+    return dictionary;
+}
+
+// With allow_store, image data compressing to more than this much of its size is stored instead.
+static const float store_ratio = 0.95f;
+
+std::vector<uint8_t> SStoz::Pack(SStoozeyPackOptions options) {
+    SStoozeyEncoder encoder;
+    return this->Pack(options, encoder);
+}
+
+std::vector<uint8_t> SStoz::Pack(SStoozeyPackOptions options, SStoozeyEncoder& encoder) {
+    // Scan orders only matter to the run encodings.
+    if (options.encoding == EStoozeyEncoding::FILTERED || options.encoding == EStoozeyEncoding::PLANAR || options.encoding == EStoozeyEncoding::QOI)
+        options.scan_order = EStoozeyScanOrder::ROW;
+    else if (options.search_scan_order && !options.search_strategies) {
+        options.search_scan_order = false;
+
+        std::vector<uint8_t> best;
+        for (auto scan_order : { EStoozeyScanOrder::ROW, EStoozeyScanOrder::COLUMN, EStoozeyScanOrder::ZORDER, EStoozeyScanOrder::HILBERT }) {
+            options.scan_order = scan_order;
+            std::vector<uint8_t> candidate = this->Pack(options, encoder);
+            if (best.empty() || candidate.size() < best.size())
+                best = std::move(candidate);
+        }
+        return best;
+    }
+
+    // The search is over deflate's own settings.
+    if (options.search_strategies && options.encoding != EStoozeyEncoding::QOI && options.compression == EStoozeyCompression::ZLIB)
+        return this->PackSearch(options);
+
+    encoder.frames.reserve((this->GetWidth() * this->GetHeight()) * 4);
+    SStoozeySaveVector image_vector(std::move(encoder.frames));
+    this->PackFrames(image_vector, options);
+
+    // Compress data, unless it's not going to pay for itself. QOI is meant
+    // to be stored as it is.
+    // The trial is a deflate one and doesn't know about dictionaries, which
+    // are exactly what lets small images compress, so it's skipped when
+    // there is one or the codec isn't zlib.
+    EStoozeyCompression compression = options.compression;
+    if (options.encoding == EStoozeyEncoding::QOI)
+        compression = EStoozeyCompression::STORE;
+    else if (compression == EStoozeyCompression::ZLIB && options.allow_store && options.dictionary == 0 && encoder.EstimateCompressionRatio(image_vector) > store_ratio)
+        compression = EStoozeyCompression::STORE;
+    if (!FindCodec(compression)->Compress(image_vector, options, encoder))
+        compression = EStoozeyCompression::STORE;
+
+    std::vector<uint8_t> file = this->PackFile(image_vector, options, compression);
+    encoder.Reclaim(image_vector);
+    return file;
+}
+
+void SStoz::PackFrames(SStoozeySaveVector& image_vector, const SStoozeyPackOptions& options) {
+    // Frames already written, by content hash, so duplicates can refer back to them
+    std::unordered_map<uint64_t, std::vector<int>> frame_hashes;
+
+    // Image data
+    for (int i = 0; i < (int) this->frames.size(); ++i) {
+        if (options.repeat_frames) {
+            std::vector<int>& candidates = frame_hashes[this->frames[i].Hash()];
+            auto match = std::find_if(candidates.begin(), candidates.end(), [&](int index) {
+                return this->frames[i].IsIdentical(this->frames[index]);
+            });
+
+            if (match != candidates.end()) {
+                image_vector.str("IMR");
+                image_vector.uleb128(*match);
+                image_vector.str("IME");
+                continue;
+            }
+
+            candidates.push_back(i);
+        }
+
+        if (options.delta_frames && i != 0)
+            this->frames[i].PackDelta(image_vector, this->frames[i - 1], options.encoding, options.scan_order);
+        else
+            this->frames[i].Pack(image_vector, options.encoding, options.scan_order);
+    }
+}
+
+std::vector<uint8_t> SStoz::PackFile(SStoozeySaveVector& image_vector, const SStoozeyPackOptions& options, EStoozeyCompression compression) {
+    SStoozeySaveVector stoz(0x100);
+
+    // Magic data
+    stoz.str("STOZ");
+    stoz.u8(0);
+
+    // The encoding is whatever this pack asks for, not what the image was loaded with.
+    std::unordered_map<EStoozeyHeaderValue, int> headers = this->headers;
+    // V3 only changes the grid when pixel_size doesn't divide the image, older
+    // readers can take the file as V2 otherwise.
+    int pixel_size = this->headers[EStoozeyHeaderValue::PIXEL_SIZE];
+    if (headers[EStoozeyHeaderValue::VERSION] == (int) EStoozeyVersion::V3 && this->GetWidth() % pixel_size == 0 && this->GetHeight() % pixel_size == 0)
+        headers[EStoozeyHeaderValue::VERSION] = (int) EStoozeyVersion::V2;
+    if (options.encoding != EStoozeyEncoding::RLE)
+        headers[EStoozeyHeaderValue::ENCODING] = (int) options.encoding;
+    else
+        headers.erase(EStoozeyHeaderValue::ENCODING);
+    if (options.scan_order != EStoozeyScanOrder::ROW)
+        headers[EStoozeyHeaderValue::SCAN_ORDER] = (int) options.scan_order;
+    else
+        headers.erase(EStoozeyHeaderValue::SCAN_ORDER);
+    if (compression != EStoozeyCompression::ZLIB)
+        headers[EStoozeyHeaderValue::COMPRESSION] = (int) compression;
+    else
+        headers.erase(EStoozeyHeaderValue::COMPRESSION);
+    if (compression != EStoozeyCompression::STORE && options.dictionary != 0)
+        headers[EStoozeyHeaderValue::DICTIONARY] = options.dictionary;
+    else
+        headers.erase(EStoozeyHeaderValue::DICTIONARY);
+
+    // Headers
+    stoz.str("HDS");
+    for (auto header : headers) {
+        stoz.uleb128((int) header.first);
+        stoz.uleb128(header.second);
+    }
+    stoz.str("HDE");
+
+    // Palette
+    if (this->GetImageMode() == EStoozeyImageMode::INDEXED) {
+        if (this->palette == nullptr)
+            throw std::runtime_error("Indexed image doesn't have a palette!");
+
+        stoz.str("PLS");
+        stoz.uleb128((unsigned int) this->palette->colors.size());
+        for (auto& color : this->palette->colors) {
+            stoz.u8(color.r);
+            stoz.u8(color.g);
+            stoz.u8(color.b);
+            stoz.u8(color.a);
+        }
+        stoz.str("PLE");
+    }
+
+    std::vector<uint8_t> compressed_data = image_vector.GetData();
+    std::vector<uint8_t> stoz_data = stoz.GetData();
+    stoz_data.insert(stoz_data.end(), compressed_data.begin(), compressed_data.end());
+
+    return stoz_data;
+}
+
+// Packs every combination of scan order, deflate level and strategy worth
+// trying, spread over all cores, and keeps the smallest file. Candidates give
+// up as soon as they can't win, and no new ones start past the time budget.
+std::vector<uint8_t> SStoz::PackSearch(SStoozeyPackOptions options) {
+    auto start = std::chrono::steady_clock::now();
+    auto deadline = start + std::chrono::milliseconds(options.search_budget_ms);
+    auto out_of_time = [&] {
+        return options.search_budget_ms > 0 && std::chrono::steady_clock::now() > deadline;
+    };
+
+    std::vector<EStoozeyScanOrder> scan_orders = { options.scan_order };
+    if (options.search_scan_order && options.encoding != EStoozeyEncoding::FILTERED && options.encoding != EStoozeyEncoding::PLANAR) {
+        scan_orders = { EStoozeyScanOrder::ROW, EStoozeyScanOrder::COLUMN, EStoozeyScanOrder::ZORDER, EStoozeyScanOrder::HILBERT };
+    }
+
+    std::vector<SStoozeySaveVector> streams(scan_orders.size(), SStoozeySaveVector((this->GetWidth() * this->GetHeight()) * 4));
+    ParallelFor((int) scan_orders.size(), [&](int i) {
+        SStoozeyPackOptions stream_options = options;
+        stream_options.scan_order = scan_orders[i];
+        this->PackFrames(streams[i], stream_options);
+    });
+
+    // Z_RLE only looks one byte back, so the level barely matters to it.
+    struct SStoozeyCandidate {
+        int stream;
+        int level;
+        EStoozeyDeflateStrategy strategy;
+    };
+    std::vector<SStoozeyCandidate> candidates;
+    for (int i = 0; i < (int) streams.size(); ++i) {
+        candidates.push_back({ i, Z_BEST_COMPRESSION, EStoozeyDeflateStrategy::DEFAULT });
+        candidates.push_back({ i, Z_BEST_COMPRESSION, EStoozeyDeflateStrategy::FILTERED });
+        candidates.push_back({ i, 6, EStoozeyDeflateStrategy::DEFAULT });
+        candidates.push_back({ i, 6, EStoozeyDeflateStrategy::FILTERED });
+        candidates.push_back({ i, Z_BEST_COMPRESSION, EStoozeyDeflateStrategy::RLE });
+    }
+
+    // Anything over the best finished candidate by this much halfway through is dropped.
+    const double losing_margin = 1.1;
+    auto dictionary = FindDictionary(options.dictionary);
+
+    std::mutex best_mutex;
+    std::atomic<size_t> best_size = SIZE_MAX;
+    int best_candidate = -1;
+    std::optional<SStoozeySaveVector> best_vector;
+
+    ParallelFor((int) candidates.size(), [&](int i) {
+        // The first candidate is the plain default, so there is always something to fall back to.
+        if (i != 0 && out_of_time()) return;
+
+        const SStoozeyCandidate& candidate = candidates[i];
+        SStoozeySaveVector image_vector = streams[candidate.stream];
+        bool gave_up = false;
+        image_vector.Compress(*dictionary, candidate.level, candidate.strategy, [&](size_t consumed, size_t total, size_t written) {
+            if (i == 0) return false;
+            size_t best = best_size;
+            if (best == SIZE_MAX) return out_of_time();
+
+            // Project the final size from how far along it is.
+            double projected = (double) written * total / std::max<size_t>(consumed, 1);
+            gave_up = written >= best || (consumed * 2 >= total && projected > best * losing_margin) || out_of_time();
+            return gave_up;
+        });
+        if (gave_up) return;
+
+        std::lock_guard<std::mutex> lock(best_mutex);
+        size_t size = image_vector.GetSize();
+        if (size < best_size || (size == best_size && i < best_candidate)) {
+            best_size = size;
+            best_candidate = i;
+            best_vector = std::move(image_vector);
+        }
+    });
+
+    const SStoozeyCandidate& winner = candidates[best_candidate];
+    options.scan_order = scan_orders[winner.stream];
+    options.compression_level = winner.level;
+    options.strategy = winner.strategy;
+
+    // zlib stands in for the optimal parser while searching, which then
+    // only has to run once, over the winning stream.
+    if (options.optimal_deflate) {
+        SStoozeySaveVector optimal_vector = streams[winner.stream];
+        if (optimal_vector.CompressOptimal(*dictionary, options.optimal_iterations) && optimal_vector.GetSize() < best_vector->GetSize())
+            best_vector = std::move(optimal_vector);
+    }
+
+    // The sizes are real here, so allow_store doesn't need a trial.
+    size_t raw_size = streams[winner.stream].GetSize();
+    size_t compressed_size = best_vector->GetSize();
+    if (compressed_size >= raw_size || (options.allow_store && compressed_size > raw_size * store_ratio))
+        return this->PackFile(streams[winner.stream], options, EStoozeyCompression::STORE);
+    return this->PackFile(*best_vector, options, EStoozeyCompression::ZLIB);
+}
+
+SStoozeyFrame::SStoozeyFrame(SStoozeyHeader header) {
+    this->image_mode = header.image_mode;
+    this->encoding = header.encoding;
+    this->scan_order = header.scan_order;
+    this->image_width = header.width;
+    this->image_height = header.height;
+    this->pixel_size = header.pixel_size;
+
+    this->grid_width = header.GetGridWidth();
+    this->grid_height = header.GetGridHeight();
+
+    this->grid = std::make_shared<SStoozeyGrid>(this->grid_height, SStoozeyRow(this->grid_width));
+}
+
+std::span<const SStoozeyPixel> SStoozeyFrame::GetPaletteColors() {
+    if (this->image_mode != EStoozeyImageMode::INDEXED)
+        return {};
+    if (this->palette == nullptr)
+        throw std::runtime_error("Indexed frame doesn't have a palette!");
+    return this->palette->colors;
+}
+
+SStoozeyGrid& SStoozeyFrame::GetMutableGrid() {
+    // Copy on write, anyone else holding the grid keeps the old pixels.
+    if (this->grid.use_count() > 1)
+        this->grid = std::make_shared<SStoozeyGrid>(*this->grid);
+    return *this->grid;
+}
+
+SStoozeyGrid& SStoozeyFrame::GetOverwrittenGrid() {
+    // Every cell gets overwritten, so there's no point copying a shared grid first.
+    if (this->grid.use_count() > 1)
+        this->grid = std::make_shared<SStoozeyGrid>(this->grid_height, SStoozeyRow(this->grid_width));
+    return *this->grid;
+}
+
+std::tuple<int, int> SStoozeyFrame::GetCellPosition(int x, int y) {
+    return {
+        std::max((int) 0, (int) std::min(this->grid_width - 1, (int) std::floor(x / this->pixel_size))),
+        std::max((int) 0, (int) std::min(this->grid_height - 1, (int) std::floor(y / this->pixel_size)))
+    };
+}
+
+SStoozeyPixel SStoozeyFrame::GetPixel(int x, int y) {
+    auto grid_position = this->GetCellPosition(x, y);
+    auto [grid_x, grid_y] = grid_position;
+    return (*this->grid)[grid_y][grid_x];
+}
+
+void SStoozeyFrame::SetPixel(int x, int y, SStoozeyPixel pixel) {
+    auto grid_position = this->GetCellPosition(x, y);
+    auto [grid_x, grid_y] = grid_position;
+    this->GetMutableGrid().GetMutableRow(grid_y)[grid_x] = pixel;
+
+    // Any edit invalidates the run index, it gets rebuilt on request.
+    if (!this->row_index.empty()) {
+        this->runs.clear();
+        this->row_index.clear();
+    }
+
+    this->has_stats = false;
+}
+
+int GetBytesPerPixel(EStoozeyPixelFormat format) {
+    switch (format) {
+        case EStoozeyPixelFormat::RGBA8:
+        case EStoozeyPixelFormat::BGRA8:
+            return 4;
+        case EStoozeyPixelFormat::RGB8:
+            return 3;
+        case EStoozeyPixelFormat::LA8:
+            return 2;
+        default:
+            return 1;
+    }
+}
+
+void SStoozeyFrame::LoadPixels(const uint8_t* source, int channels, size_t stride) {
+    static const EStoozeyPixelFormat formats[] = {
+        EStoozeyPixelFormat::L8,
+        EStoozeyPixelFormat::LA8,
+        EStoozeyPixelFormat::RGB8,
+        EStoozeyPixelFormat::RGBA8
+    };
+
+    if (channels < 1 || channels > 4)
+        throw std::runtime_error("Unsupported channel count!");
+    this->LoadPixels(source, formats[channels - 1], stride);
+}
+
+void SStoozeyFrame::LoadPixels(const uint8_t* source, EStoozeyPixelFormat format, size_t stride) {
+    SStoozeyGrid& grid = this->GetOverwrittenGrid();
+
+    this->runs.clear();
+    this->row_index.clear();
+    this->has_stats = false;
+
+    int bytes_per_pixel = GetBytesPerPixel(format);
+    for (int y = 0; y < this->grid_height; ++y) {
+        const uint8_t* src = source + ((size_t) (y * this->pixel_size) * stride);
+        SStoozeyPixel* dst = grid.GetMutableRow(y).data();
+
+        // Cells past one pixel in size take the sample at their top left corner.
+        if (this->pixel_size != 1) {
+            for (int x = 0; x < this->grid_width; ++x) {
+                const uint8_t* p = src + ((size_t) (x * this->pixel_size) * bytes_per_pixel);
+                switch (format) {
+                    case EStoozeyPixelFormat::RGBA8: dst[x] = { .r = p[0], .g = p[1], .b = p[2], .a = p[3] }; break;
+                    case EStoozeyPixelFormat::BGRA8: dst[x] = { .r = p[2], .g = p[1], .b = p[0], .a = p[3] }; break;
+                    case EStoozeyPixelFormat::RGB8: dst[x] = { .r = p[0], .g = p[1], .b = p[2], .a = 0xFF }; break;
+                    case EStoozeyPixelFormat::LA8: dst[x] = { .r = p[0], .g = p[0], .b = p[0], .a = p[1] }; break;
+                    case EStoozeyPixelFormat::L8: dst[x] = { .r = p[0], .g = p[0], .b = p[0], .a = 0xFF }; break;
+                }
+            }
+            continue;
+        }
+
+        int x = 0;
+        switch (format) {
+            case EStoozeyPixelFormat::RGBA8:
+                memcpy(dst, src, this->grid_width * sizeof(SStoozeyPixel));
+                break;
+            case EStoozeyPixelFormat::BGRA8:
+#if defined(__SSSE3__)
+                {
+                    const __m128i shuffle = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+                    for (; x + 4 <= this->grid_width; x += 4) {
+                        __m128i bgra = _mm_loadu_si128((const __m128i*) (src + (x * 4)));
+                        _mm_storeu_si128((__m128i*) (dst + x), _mm_shuffle_epi8(bgra, shuffle));
+                    }
+                }
+#endif
+                for (; x < this->grid_width; ++x)
+                    dst[x] = { .r = src[(x * 4) + 2], .g = src[(x * 4) + 1], .b = src[x * 4], .a = src[(x * 4) + 3] };
+                break;
+            case EStoozeyPixelFormat::RGB8:
+#if defined(__SSSE3__)
+                {
+                    // Four pixels at a time, each 16 byte load only has 12 bytes of
+                    // them, so stop while there's still a full load left.
+                    const __m128i shuffle = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+                    const __m128i alpha = _mm_set1_epi32((int) 0xFF000000);
+                    for (; x + 6 <= this->grid_width; x += 4) {
+                        __m128i rgb = _mm_loadu_si128((const __m128i*) (src + (x * 3)));
+                        _mm_storeu_si128((__m128i*) (dst + x), _mm_or_si128(_mm_shuffle_epi8(rgb, shuffle), alpha));
+                    }
+                }
+#endif
+                for (; x < this->grid_width; ++x)
+                    dst[x] = { .r = src[x * 3], .g = src[(x * 3) + 1], .b = src[(x * 3) + 2], .a = 0xFF };
+                break;
+            case EStoozeyPixelFormat::LA8:
+                for (; x < this->grid_width; ++x)
+                    dst[x] = { .r = src[x * 2], .g = src[x * 2], .b = src[x * 2], .a = src[(x * 2) + 1] };
+                break;
+            case EStoozeyPixelFormat::L8:
+                for (; x < this->grid_width; ++x)
+                    dst[x] = { .r = src[x], .g = src[x], .b = src[x], .a = 0xFF };
+                break;
+        }
+    }
+}
+
+void SStoozeyFrame::BuildRowIndex() {
+    this->runs.clear();
+    this->row_index.clear();
+    this->row_index.reserve(this->grid_height + 1);
+
+    for (int y = 0; y < this->grid_height; ++y) {
+        const SStoozeyRow& row = (*this->grid)[y];
+        for (int x = 0; x < this->grid_width; ++x) {
+            SStoozeyPixel pixel = row[x];
+            if (this->runs.empty() || *((uint32_t*)&this->runs.back().pixel) != *((uint32_t*)&pixel))
+                this->runs.push_back({ .start = (unsigned int) (y * this->grid_width + x), .pixel = pixel });
+
+            // Either a fresh run or the one carried over from the previous row.
+            if (x == 0) this->row_index.push_back((unsigned int) this->runs.size() - 1);
+        }
+    }
+
+    this->row_index.push_back((unsigned int) this->runs.size());
+}
+
+SStoozeyPixel SStoozeyFrame::SampleRLE(int x, int y) {
+    if (this->row_index.empty())
+        throw std::runtime_error("Frame has no row index!");
+
+    auto [grid_x, grid_y] = this->GetCellPosition(x, y);
+    unsigned int cell = (grid_y * this->grid_width) + grid_x;
+
+    // Runs overlapping this row are [row_index[y], row_index[y + 1]], the
+    // last one being the run that spills into the next row, if any.
+    auto first = this->runs.begin() + this->row_index[grid_y];
+    auto last = this->runs.begin() + std::min((size_t) this->row_index[grid_y + 1] + 1, this->runs.size());
+    auto run = std::upper_bound(first, last, cell, [](unsigned int value, const SStoozeyRun& run) {
+        return value < run.start;
+    });
+
+    return (run - 1)->pixel;
+}
+
+SStoozeyRunIterator::SStoozeyRunIterator(SStoozeyFrame* frame) {
+    this->frame = frame;
+    this->cell_count = frame->grid_width * frame->grid_height;
+    this->done = false;
+    this->Next();
+}
+
+SStoozeyRunIterator::SStoozeyRunIterator(SStoozeyLoadVector* stream, EStoozeyImageMode image_mode, EStoozeyEncoding encoding, unsigned int cell_count, std::span<const SStoozeyPixel> palette) {
+    if (encoding != EStoozeyEncoding::RLE && encoding != EStoozeyEncoding::PACKBITS)
+        throw std::runtime_error("Encoding isn't made of runs!");
+
+    this->stream = stream;
+    this->image_mode = image_mode;
+    this->encoding = encoding;
+    this->palette = palette;
+    this->cell_count = cell_count;
+    this->done = false;
+    this->Next();
+}
+
+static SStoozeyPixel ReadPixel(SStoozeyLoadVector& stream, EStoozeyImageMode image_mode, std::span<const SStoozeyPixel> palette) {
+    SStoozeyPixel pixel;
+    if (image_mode == EStoozeyImageMode::RGBA) {
+        pixel = *(SStoozeyPixel*)(stream.GetPointer());
+        stream.Forward(4);
+    }
+    else if (image_mode == EStoozeyImageMode::INDEXED) {
+        uint8_t index = stream.u8();
+        if (palette.empty()) pixel = { .r = index };
+        else if (index < palette.size()) pixel = palette[index];
+        else throw std::runtime_error("Palette index is out of range!");
+    }
+    else if (image_mode == EStoozeyImageMode::RGB) {
+        pixel = {
+            .r = stream.u8(),
+            .g = stream.u8(),
+            .b = stream.u8(),
+            .a = 0xFF
+        };
+    }
+    else {
+        uint8_t value = stream.u8();
+        pixel = { .r = value, .g = value, .b = value };
+    }
+
+    return pixel;
+}
+
+// ReadPixel for a whole span of cells, writing them out in one go.
+static void ReadPixels(SStoozeyLoadVector& stream, EStoozeyImageMode image_mode, std::span<const SStoozeyPixel> palette, SStoozeyPixel* out, unsigned int count) {
+    size_t length = (size_t) count * GetBytesPerCell(image_mode);
+    if (stream.GetRemaining() < length)
+        throw std::runtime_error("Literal packet is truncated!");
+
+    const uint8_t* in = stream.GetPointer();
+    switch (image_mode) {
+        case EStoozeyImageMode::RGBA:
+            memcpy(out, in, length);
+            break;
+        case EStoozeyImageMode::RGB:
+            for (unsigned int i = 0; i < count; ++i)
+                out[i] = { .r = in[i * 3], .g = in[i * 3 + 1], .b = in[i * 3 + 2], .a = 0xFF };
+            break;
+        case EStoozeyImageMode::INDEXED:
+            for (unsigned int i = 0; i < count; ++i) {
+                if (palette.empty()) out[i] = { .r = in[i] };
+                else if (in[i] < palette.size()) out[i] = palette[in[i]];
+                else throw std::runtime_error("Palette index is out of range!");
+            }
+            break;
+        default:
+            for (unsigned int i = 0; i < count; ++i)
+                out[i] = { .r = in[i], .g = in[i], .b = in[i] };
+            break;
+    }
+
+    stream.Forward((unsigned int) length);
+}
+
+// Decodes PACKBITS packets straight into the grid a row span at a time, so
+// literal packets get copied in bulk rather than as runs of one.
+void SStoozeyFrame::UnpackPackBits(SStoozeyLoadVector& stoz, int rect_x, int rect_y, int rect_width, int rect_height) {
+    std::span<const SStoozeyPixel> colors = this->GetPaletteColors();
+    unsigned int cell_count = rect_width * rect_height;
+    unsigned int rect_index = 0;
+
+    while (rect_index < cell_count) {
+        unsigned int packet = stoz.uleb128();
+        bool literal = packet & 1;
+        // Never let a malformed stream run past the end of the rectangle.
+        unsigned int count = std::min((packet >> 1) + 1, cell_count - rect_index);
+        SStoozeyPixel pixel = {};
+        if (!literal) pixel = ReadPixel(stoz, this->image_mode, colors);
+
+        while (count > 0) {
+            unsigned int x = rect_index % rect_width;
+            unsigned int y = rect_index / rect_width;
+            unsigned int span = std::min(count, rect_width - x);
+
+            SStoozeyPixel* row = this->GetMutableGrid().GetMutableRow(rect_y + y).data() + rect_x + x;
+            if (literal) ReadPixels(stoz, this->image_mode, colors, row, span);
+            else std::fill(row, row + span, pixel);
+
+            rect_index += span;
+            count -= span;
+        }
+    }
+}
+
+void SStoozeyRunIterator::Next() {
+    if (this->cell >= this->cell_count) {
+        this->done = true;
+        return;
+    }
+
+    if (this->stream != nullptr) {
+        SStoozeyLoadVector& stream = *this->stream;
+
+        unsigned int count;
+        if (this->encoding == EStoozeyEncoding::PACKBITS) {
+            if (this->literal_count == 0) {
+                unsigned int packet = stream.uleb128();
+                count = (packet >> 1) + 1;
+                if (packet & 1) this->literal_count = count;
+            }
+
+            if (this->literal_count != 0) {
+                this->literal_count--;
+                count = 1;
+            }
+        }
+        else count = stream.uleb128();
+
+        SStoozeyPixel pixel = ReadPixel(stream, this->image_mode, this->palette);
+
+        // Never let a malformed stream run past the end of the grid.
+        count = std::min(count, this->cell_count - this->cell);
+        this->run = { .count = count, .pixel = pixel };
+        this->cell += count;
+        return;
+    }
+
+    SStoozeyFrame& frame = *this->frame;
+
+    // Decoded runs are already maximal, no need to scan the grid for them.
+    if (!frame.row_index.empty()) {
+        const SStoozeyRun& current = frame.runs[this->run_index++];
+        unsigned int end = this->run_index < frame.runs.size() ? frame.runs[this->run_index].start : this->cell_count;
+        this->run = { .count = end - current.start, .pixel = current.pixel };
+        this->cell = end;
+        return;
+    }
+
+    int x = this->cell % frame.grid_width;
+    int y = this->cell / frame.grid_width;
+    const SStoozeyGrid& grid = *frame.grid;
+    SStoozeyPixel pixel = grid[y][x];
+    uint32_t value = *((uint32_t*)&pixel);
+
+    unsigned int count = 0;
+    for (; y < frame.grid_height; ++y, x = 0) {
+        const SStoozeyPixel* row = grid[y].data();
+        int start = x;
+        while (x < frame.grid_width && *((uint32_t*)&row[x]) == value) ++x;
+        count += x - start;
+        if (x != frame.grid_width) break;
+    }
+
+    this->run = { .count = count, .pixel = pixel };
+    this->cell += count;
+}
+
+class SStoozeyStatsAccumulator {
+    public:
+        SStoozeyStatsAccumulator(SStoozeyFrame& frame) : frame(frame) {
+            // Only compare the channels the image mode actually stores.
+            if (frame.image_mode == EStoozeyImageMode::L) this->mask = 0x000000ff;
+            else if (frame.image_mode == EStoozeyImageMode::RGB) this->mask = 0x00ffffff;
+        }
+
+        void Add(unsigned int start, const SStoozeyRunLength& run) {
+            uint32_t color = *((uint32_t*)&run.pixel) & this->mask;
+            if (this->colors.empty() || color != this->last_color) {
+                this->colors.insert(color);
+                this->last_color = color;
+            }
+
+            this->cell_count += run.count;
+            if (run.pixel.a == 0x00) {
+                this->transparent_count += run.count;
+                return;
+            }
+            if (run.pixel.a == 0xFF)
+                this->opaque_count += run.count;
+
+            // A run spanning rows covers every column once it wraps around.
+            int first_row = start / this->frame.grid_width;
+            int last_row = (start + run.count - 1) / this->frame.grid_width;
+            int first_column = first_row == last_row ? start % this->frame.grid_width : 0;
+            int last_column = first_row == last_row ? (start + run.count - 1) % this->frame.grid_width : this->frame.grid_width - 1;
+
+            this->min_x = std::min(this->min_x, first_column);
+            this->max_x = std::max(this->max_x, last_column);
+            this->min_y = std::min(this->min_y, first_row);
+            this->max_y = std::max(this->max_y, last_row);
+        }
+
+        SStoozeyFrameStats Finish() {
+            SStoozeyFrameStats stats = {
+                .cell_count = this->cell_count,
+                .transparent_count = this->transparent_count,
+                .opaque_count = this->opaque_count,
+                .unique_colors = (unsigned int) this->colors.size(),
+            };
+
+            if (this->max_x < 0) return stats;
+
+            // The last row and column also cover whatever the grid rounded away.
+            int pixel_size = this->frame.pixel_size;
+            stats.bbox_x = this->min_x * pixel_size;
+            stats.bbox_y = this->min_y * pixel_size;
+            stats.bbox_width = (this->max_x == this->frame.grid_width - 1 ? this->frame.image_width : (this->max_x + 1) * pixel_size) - stats.bbox_x;
+            stats.bbox_height = (this->max_y == this->frame.grid_height - 1 ? this->frame.image_height : (this->max_y + 1) * pixel_size) - stats.bbox_y;
+
+            return stats;
+        }
+    private:
+        SStoozeyFrame& frame;
+        uint32_t mask = 0xffffffff;
+
+        std::unordered_set<uint32_t> colors;
+        uint32_t last_color = 0;
+
+        unsigned int cell_count = 0;
+        unsigned int transparent_count = 0;
+        unsigned int opaque_count = 0;
+
+        int min_x = INT_MAX, min_y = INT_MAX;
+        int max_x = -1, max_y = -1;
+};
+
+SStoozeyFrameStats ComputeFrameStats(SStoozeyFrame& frame) {
+    SStoozeyStatsAccumulator stats(frame);
+    unsigned int start = 0;
+    ForEachRun(frame, [&](const SStoozeyRunLength& run) {
+        stats.Add(start, run);
+        start += run.count;
+    });
+
+    return stats.Finish();
+}
+
+SStoozeyFrameStats SStoozeyFrame::GetStats() {
+    if (!this->has_stats) {
+        this->stats = ComputeFrameStats(*this);
+        this->has_stats = true;
+    }
+
+    return this->stats;
+}
+
+SStoozeyHeader SStoz::Open(SStoozeyLoadVector& load_vector, std::vector<SStoozeyPixel>* palette, SStoozeyDecoder* decoder) {
+    if (load_vector.str(4) != "STOZ")
+        throw std::runtime_error("File supplied isn't a STOZ file!");
+    load_vector.u8();
+    if (load_vector.str(3) != "HDS")
+        throw std::runtime_error("Expected header start!");
+
+    SStoozeyHeader header;
+    // This surely isn't a problematic way to do this.
+    while (strncmp((const char*)load_vector.GetPointer(), "HDE", 3) != 0) {
+        unsigned int key = load_vector.uleb128();
+        unsigned int value = load_vector.uleb128();
+        // Keys from a newer writer have nowhere to go.
+        if (key >= sizeof(SStoozeyHeader) / sizeof(unsigned int))
+            throw std::runtime_error("Unknown header value!");
+        // Copied bytewise, the fields aren't all ints and the optimizer is free
+        // to ignore stores to them made through an unsigned int pointer.
+        memcpy((uint8_t*)&header + (key * sizeof(unsigned int)), &value, sizeof(unsigned int));
+    }
+    load_vector.str(3);
+
+    if (header.image_mode == EStoozeyImageMode::INDEXED) {
+        if (load_vector.str(3) != "PLS")
+            throw std::runtime_error("Expected palette start!");
+
+        unsigned int color_count = load_vector.uleb128();
+        if (color_count > 256)
+            throw std::runtime_error("Palette can't have more than 256 colors!");
+
+        std::vector<SStoozeyPixel> colors(color_count);
+        for (auto& color : colors)
+            color = { .r = load_vector.u8(), .g = load_vector.u8(), .b = load_vector.u8(), .a = load_vector.u8() };
+
+        if (load_vector.str(3) != "PLE")
+            throw std::runtime_error("Expected palette end!");
+        if (palette != nullptr)
+            *palette = std::move(colors);
+    }
+
+    // Over-estimate of size since format doesn't store uncompressed size
+    unsigned int uncompressed_size = (header.width * header.height) * 0x8;
+    SStoozeyDecoder temporary;
+    FindCodec(header.compression)->Decompress(load_vector, uncompressed_size, header, decoder != nullptr ? *decoder : temporary);
+
+    return header;
+}
+
+std::shared_ptr<SStoz> SStoz::Load(const char* filename, SStoozeyLoadOptions options) {
+    SStoozeyDecoder decoder;
+    return decoder.Load(filename, options);
+}
+
+std::shared_ptr<SStoz> SStoozeyDecoder::Load(const char* filename, SStoozeyLoadOptions options) {
+    SStoozeyLoadVector load_vector(filename, std::move(this->file));
+    std::vector<SStoozeyPixel> palette;
+    SStoozeyHeader header = SStoz::Open(load_vector, &palette, this);
+
+    auto stoz = std::make_shared<SStoz>(header);
+    if (header.image_mode == EStoozeyImageMode::INDEXED)
+        stoz->SetPalette(std::move(palette));
+    for (int i = 0; i < header.frame_count; ++i) {
+        // Repeated frames just take the already decoded frame they refer to.
+        if (strncmp((const char*)load_vector.GetPointer(), "IMR", 3) == 0) {
+            load_vector.str(3);
+            unsigned int reference = load_vector.uleb128();
+            if (reference >= (unsigned int) i)
+                throw std::runtime_error("Repeated frame refers to a frame that hasn't been decoded!");
+            if (load_vector.str(3) != "IME")
+                throw std::runtime_error("Expected frame end!");
+
+            stoz->frames[i] = stoz->frames[reference];
+            continue;
+        }
+
+        stoz->frames[i].Unpack(load_vector, options, (i != 0) ? &stoz->frames[i - 1] : nullptr);
+    }
+
+    // Frames don't point into the stream, so its memory can go to the next file.
+    this->file = std::move(load_vector.data);
+    return stoz;
+}
+
+void SStoozeyFrame::Unpack(SStoozeyLoadVector& stoz, SStoozeyLoadOptions options, SStoozeyFrame* previous) {
+    std::string magic = stoz.str(3);
+    if (magic == "IMD") {
+        if (previous == nullptr)
+            throw std::runtime_error("Delta frame has no previous frame!");
+        this->UnpackDelta(stoz, options, *previous);
+        return;
+    }
+
+    if (magic != "IMS")
+        throw std::runtime_error("Expected frame start!");
+
+    if (this->encoding != EStoozeyEncoding::RLE || this->scan_order != EStoozeyScanOrder::ROW) {
+        SStoozeyGrid& grid = this->GetOverwrittenGrid();
+
+        if (this->encoding == EStoozeyEncoding::FILTERED)
+            this->UnpackRows(stoz, 0, 0, this->grid_width, this->grid_height);
+        else if (this->encoding == EStoozeyEncoding::PLANAR)
+            this->UnpackPlanes(stoz, 0, 0, this->grid_width, this->grid_height, options.alpha_only);
+        else if (this->encoding == EStoozeyEncoding::QOI)
+            this->UnpackQOI(stoz, 0, 0, this->grid_width, this->grid_height);
+        else if (this->encoding == EStoozeyEncoding::PACKBITS && this->scan_order == EStoozeyScanOrder::ROW)
+            this->UnpackPackBits(stoz, 0, 0, this->grid_width, this->grid_height);
+        else {
+            auto table = GetScanTable(this->scan_order, this->grid_width, this->grid_height);
+            const unsigned int* cell = table->data();
+            SStoozeyRunRange runs = { SStoozeyRunIterator(&stoz, this->image_mode, this->encoding, (unsigned int) table->size(), this->GetPaletteColors()) };
+            for (const SStoozeyRunLength& run : runs) {
+                for (unsigned int i = 0; i < run.count; ++i, ++cell)
+                    grid.GetMutableRow(*cell / this->grid_width)[*cell % this->grid_width] = run.pixel;
+            }
+        }
+
+        // The stream has no maximal runs in row order, so the index and stats come from the grid.
+        this->runs.clear();
+        this->row_index.clear();
+        this->has_stats = false;
+        if (options.build_row_index) this->BuildRowIndex();
+        if (options.compute_stats) this->GetStats();
+
+        if (stoz.str(3) != "IME")
+            throw std::runtime_error("Expected frame end!");
+        return;
+    }
+
+    bool build_row_index = options.build_row_index;
+    this->runs.clear();
+    this->row_index.clear();
+    if (build_row_index)
+        this->row_index.reserve(this->grid_height + 1);
+
+    SStoozeyStatsAccumulator stats(*this);
+    this->has_stats = false;
+
+    SStoozeyGrid& grid = this->GetOverwrittenGrid();
+
+    unsigned int grid_index = 0;
+    SStoozeyRunRange runs = { SStoozeyRunIterator(&stoz, this->image_mode, this->encoding, this->grid_width * this->grid_height, this->GetPaletteColors()) };
+    for (const SStoozeyRunLength& run : runs) {
+        unsigned int count = run.count;
+        if (count == 0) continue;
+
+        if (options.compute_stats)
+            stats.Add(grid_index, run);
+
+        if (build_row_index) {
+            // Nothing stops a writer from splitting a run, keep the stored runs maximal.
+            if (this->runs.empty() || *((uint32_t*)&this->runs.back().pixel) != *((uint32_t*)&run.pixel))
+                this->runs.push_back({ .start = grid_index, .pixel = run.pixel });
+            // Every row starting inside this run points back at it.
+            unsigned int last_row = (grid_index + count - 1) / this->grid_width;
+            while (this->row_index.size() <= last_row)
+                this->row_index.push_back((unsigned int) this->runs.size() - 1);
+        }
+
+        // Fill the run a row span at a time rather than cell by cell.
+        while (count > 0) {
+            unsigned int x = grid_index % this->grid_width;
+            unsigned int y = grid_index / this->grid_width;
+            unsigned int span = std::min(count, this->grid_width - x);
+
+            SStoozeyRow& row = grid.GetMutableRow(y);
+            std::fill(row.begin() + x, row.begin() + x + span, run.pixel);
+
+            grid_index += span;
+            count -= span;
+        }
+    }
+
+    if (build_row_index)
+        this->row_index.push_back((unsigned int) this->runs.size());
+
+    if (options.compute_stats) {
+        this->stats = stats.Finish();
+        this->has_stats = true;
+    }
+
+    if (stoz.str(3) != "IME")
+        throw std::runtime_error("Expected frame end!");
+}
+
+void SStoozeyFrame::UnpackDelta(SStoozeyLoadVector& stoz, SStoozeyLoadOptions options, SStoozeyFrame& previous) {
+    int rect_x = stoz.uleb128();
+    int rect_y = stoz.uleb128();
+    int rect_width = stoz.uleb128();
+    int rect_height = stoz.uleb128();
+
+    if (rect_x + rect_width > this->grid_width || rect_y + rect_height > this->grid_height)
+        throw std::runtime_error("Delta frame rectangle is out of bounds!");
+
+    // Share the previous grid, it's only copied once the rectangle actually changes something.
+    this->grid = previous.grid;
+
+    if (this->encoding == EStoozeyEncoding::FILTERED)
+        this->UnpackRows(stoz, rect_x, rect_y, rect_width, rect_height);
+    else if (this->encoding == EStoozeyEncoding::PLANAR)
+        this->UnpackPlanes(stoz, rect_x, rect_y, rect_width, rect_height, options.alpha_only);
+    else if (this->encoding == EStoozeyEncoding::QOI)
+        this->UnpackQOI(stoz, rect_x, rect_y, rect_width, rect_height);
+    else if (this->encoding == EStoozeyEncoding::PACKBITS)
+        this->UnpackPackBits(stoz, rect_x, rect_y, rect_width, rect_height);
+    else {
+        unsigned int rect_index = 0;
+        SStoozeyRunRange runs = { SStoozeyRunIterator(&stoz, this->image_mode, this->encoding, rect_width * rect_height, this->GetPaletteColors()) };
+        for (const SStoozeyRunLength& run : runs) {
+            unsigned int count = run.count;
+            while (count > 0) {
+                unsigned int x = rect_index % rect_width;
+                unsigned int y = rect_index / rect_width;
+                unsigned int span = std::min(count, rect_width - x);
+
+                SStoozeyRow& row = this->GetMutableGrid().GetMutableRow(rect_y + y);
+                std::fill(row.begin() + rect_x + x, row.begin() + rect_x + x + span, run.pixel);
+
+                rect_index += span;
+                count -= span;
+            }
+        }
+    }
+
+    // Runs only describe the rectangle, so the index and stats come from the grid instead.
+    this->runs.clear();
+    this->row_index.clear();
+    this->has_stats = false;
+    if (options.build_row_index) this->BuildRowIndex();
+    if (options.compute_stats) this->GetStats();
+
+    if (stoz.str(3) != "IME")
+        throw std::runtime_error("Expected frame end!");
+}
+
+// Finds the largest block size every block of the image is uniform in. A block
+// size works if and only if every color change along a row or down a column
+// lands on a multiple of it, so it's the gcd of all those positions, folded
+// into the running result so animations can share one size across frames.
+static int DetectPixelSize(const uint8_t* image, int width, int height, int channels, int pixel_size) {
+    size_t stride = (size_t) width * channels;
+    for (int y = 0; y < height; ++y) {
+        const uint8_t* row = image + (y * stride);
+
+        // A row matching the one above has the exact same horizontal changes.
+        if (y != 0) {
+            if (memcmp(row, row - stride, stride) == 0) continue;
+            pixel_size = std::gcd(pixel_size, y);
+            if (pixel_size == 1) return 1;
+        }
+
+        for (int x = 1; x < width; ++x) {
+            if (memcmp(row + (x * channels), row + ((x - 1) * channels), channels) == 0) continue;
+            pixel_size = std::gcd(pixel_size, x);
+            if (pixel_size == 1) return 1;
+        }
+    }
+
+    return pixel_size;
+}
+
+// Runs body over [0, count) on every hardware thread, rethrowing the first exception once they're all done.
+static void ParallelFor(int count, const std::function<void(int)>& body) {
+    int thread_count = std::min(count, (int) std::max(1u, std::thread::hardware_concurrency()));
+    if (thread_count <= 1) {
+        for (int i = 0; i < count; ++i)
+            body(i);
+        return;
+    }
+
+    std::atomic<int> next = 0;
+    std::exception_ptr exception;
+    std::mutex exception_mutex;
+
+    std::vector<std::thread> threads;
+    threads.reserve(thread_count);
+    for (int t = 0; t < thread_count; ++t) {
+        threads.emplace_back([&] {
+            for (int i = next++; i < count; i = next++) {
+                try { body(i); }
+                catch (...) {
+                    std::lock_guard<std::mutex> lock(exception_mutex);
+                    if (!exception) exception = std::current_exception();
+                }
+            }
+        });
+    }
+
+    for (auto& thread : threads)
+        thread.join();
+
+    if (exception)
+        std::rethrow_exception(exception);
+}
+
+// Exact unique color counting over an open addressing table, which gives up
+// as soon as there are more colors than an INDEXED image can hold. Also keeps
+// count of how many runs a scan would produce, to weigh the palette's cost.
+class SStoozeyPaletteBuilder {
+    public:
+        bool Add(SStoozeyPixel pixel) {
+            uint32_t color = *((uint32_t*)&pixel);
+            if (this->runs != 0 && color == this->last_color) return true;
+
+            this->runs++;
+            this->last_color = color;
+
+            uint64_t key = color | (1ull << 32);
+            uint32_t slot = (color * 0x9E3779B1u) >> (32 - table_bits);
+            while (this->table[slot] != 0) {
+                if (this->table[slot] == key) return true;
+                slot = (slot + 1) & (table_size - 1);
+            }
+
+            if (this->colors.size() == 256) return false;
+            this->table[slot] = key;
+            this->colors.push_back(pixel);
+            return true;
+        }
+
+        // Whether one byte indices save more than the palette chunk takes up.
+        // The runs get deflated while the palette doesn't, so the savings are
+        // weighed at a conservative 8:1 compression ratio.
+        bool IsWorthwhile(int bytes_per_color) {
+            return ((this->runs * (size_t) (bytes_per_color - 1)) / 8) > (this->colors.size() * 4);
+        }
+
+        std::vector<SStoozeyPixel> colors;
+    private:
+        static constexpr int table_bits = 10;
+        static constexpr int table_size = 1 << table_bits;
+
+        uint64_t table[table_size] = {};
+        uint32_t last_color = 0;
+        size_t runs = 0;
+};
+
+// Fills in the palette and returns true if the image fits in one and is smaller for it.
+static bool DetectPalette(const uint8_t* image, size_t pixel_count, int channels, EStoozeyImageMode image_mode, std::vector<SStoozeyPixel>& palette) {
+    if (image_mode != EStoozeyImageMode::RGB && image_mode != EStoozeyImageMode::RGBA)
+        return false;
+
+    SStoozeyPaletteBuilder builder;
+    for (size_t i = 0; i < pixel_count; ++i) {
+        const uint8_t* p = image + (i * channels);
+
+        SStoozeyPixel pixel;
+        if (channels == 4) pixel = { .r = p[0], .g = p[1], .b = p[2], .a = p[3] };
+        else if (channels == 3) pixel = { .r = p[0], .g = p[1], .b = p[2], .a = 0xFF };
+        else pixel = { .r = p[0], .g = p[0], .b = p[0], .a = (uint8_t) ((channels == 2) ? p[1] : 0xFF) };
+
+        if (!builder.Add(pixel)) return false;
+    }
+
+    if (!builder.IsWorthwhile((image_mode == EStoozeyImageMode::RGBA) ? 4 : 3))
+        return false;
+
+    palette = std::move(builder.colors);
+    return true;
+}
+
+// 4x4 Bayer matrix, thresholds are (value + 0.5) / 16 of a quantization step.
+static const uint8_t bayer_matrix[4][4] = {
+    {  0,  8,  2, 10 },
+    { 12,  4, 14,  6 },
+    {  3, 11,  1,  9 },
+    { 15,  7, 13,  5 }
+};
+
+// Brings 16-bit samples down to 8-bit, either rounding to nearest or adding
+// an ordered dither threshold before truncating. Alpha is always rounded.
+static void QuantizeRow(const uint16_t* source, uint8_t* dest, int width, int y, int channels, EStoozeyQuantization quantization) {
+    bool has_alpha = (channels == 2) || (channels == 4);
+
+    uint32_t thresholds[4];
+    for (int i = 0; i < 4; ++i) {
+        thresholds[i] = (quantization == EStoozeyQuantization::ORDERED_DITHER)
+            ? (((bayer_matrix[y & 3][i] * 2) + 1) * 65535u) / 32u
+            : 32767u;
+    }
+
+    int color_channels = has_alpha ? channels - 1 : channels;
+    for (int x = 0; x < width; ++x, source += channels, dest += channels) {
+        uint32_t threshold = thresholds[x & 3];
+        for (int c = 0; c < color_channels; ++c)
+            dest[c] = (uint8_t) std::min(((source[c] * 255u) + threshold) / 65535u, 255u);
+        if (has_alpha)
+            dest[color_channels] = (uint8_t) (((source[color_channels] * 255u) + 32767u) / 65535u);
+    }
+}
+
+// HDR sources are linear, so they're gamma corrected the same way stb does it before quantizing.
+static void QuantizeRow(const float* source, uint8_t* dest, int width, int y, int channels, EStoozeyQuantization quantization) {
+    bool has_alpha = (channels == 2) || (channels == 4);
+
+    float thresholds[4];
+    for (int i = 0; i < 4; ++i) {
+        thresholds[i] = (quantization == EStoozeyQuantization::ORDERED_DITHER)
+            ? (bayer_matrix[y & 3][i] + 0.5f) / 16.0f
+            : 0.5f;
+    }
+
+    int color_channels = has_alpha ? channels - 1 : channels;
+    for (int x = 0; x < width; ++x, source += channels, dest += channels) {
+        float threshold = thresholds[x & 3];
+        for (int c = 0; c < color_channels; ++c) {
+            float value = std::pow(std::clamp(source[c], 0.0f, 1.0f), 1.0f / 2.2f);
+            dest[c] = (uint8_t) std::min((value * 255.0f) + threshold, 255.0f);
+        }
+        if (has_alpha)
+            dest[color_channels] = (uint8_t) ((std::clamp(source[color_channels], 0.0f, 1.0f) * 255.0f) + 0.5f);
+    }
+}
+
+template <typename T>
+static void QuantizePixels(const T* source, uint8_t* dest, int width, int height, int channels, EStoozeyQuantization quantization) {
+    constexpr int rows_per_task = 32;
+    size_t stride = (size_t) width * channels;
+    ParallelFor((height + rows_per_task - 1) / rows_per_task, [&](int task) {
+        int end = std::min(height, (task + 1) * rows_per_task);
+        for (int y = task * rows_per_task; y < end; ++y)
+            QuantizeRow(source + (y * stride), dest + (y * stride), width, y, channels, quantization);
+    });
+}
+
+// Narrowest image mode that still holds every pixel exactly. Both checks are
+// branch-free OR/AND reductions the compiler can vectorize, and the scan
+// stops as soon as the source turns out to need full RGBA.
+static EStoozeyImageMode DetectImageMode(const uint8_t* image, size_t pixel_count, int channels) {
+    bool has_color = channels >= 3;
+    bool has_alpha = (channels == 2) || (channels == 4);
+
+    uint8_t color_diff = 0;
+    uint8_t alpha = 0xFF;
+
+    constexpr size_t block_size = 4096;
+    for (size_t start = 0; start < pixel_count; start += block_size) {
+        const uint8_t* pixels = image + (start * channels);
+        size_t count = std::min(block_size, pixel_count - start);
+
+        if (channels == 4) {
+            for (size_t i = 0; i < count; ++i) {
+                const uint8_t* p = pixels + (i * 4);
+                color_diff |= (p[0] ^ p[1]) | (p[0] ^ p[2]);
+                alpha &= p[3];
+            }
+        }
+        else if (channels == 3) {
+            for (size_t i = 0; i < count; ++i) {
+                const uint8_t* p = pixels + (i * 3);
+                color_diff |= (p[0] ^ p[1]) | (p[0] ^ p[2]);
+            }
+        }
+        else if (channels == 2) {
+            for (size_t i = 0; i < count; ++i)
+                alpha &= pixels[(i * 2) + 1];
+        }
+
+        if ((!has_color || color_diff != 0) && (!has_alpha || alpha != 0xFF))
+            break;
+    }
+
+    // There's no gray with alpha mode, so any transparency means RGBA.
+    if (has_alpha && alpha != 0xFF) return EStoozeyImageMode::RGBA;
+    if (has_color && color_diff != 0) return EStoozeyImageMode::RGB;
+    return EStoozeyImageMode::L;
+}
+
+std::shared_ptr<SStoz> SStoz::FromImage(const char* filename, SStoozeyImportOptions options) {
+    std::ifstream stream(filename, std::ios::in | std::ios::binary);
+    if (!stream.good())
+        throw std::runtime_error("File doesn't exist!");
+
+    std::vector<uint8_t> file((std::istreambuf_iterator<char>(stream)), std::istreambuf_iterator<char>());
+    if (file.size() >= 4 && memcmp(file.data(), "GIF8", 4) == 0)
+        return SStoz::FromGif(file, options);
+
+    int width, height, channels;
+    std::unique_ptr<uint8_t, void(*)(void*)> loaded(nullptr, stbi_image_free);
+    std::vector<uint8_t> quantized;
+    const uint8_t* image = nullptr;
+
+    // High bit depth sources get quantized down to 8-bit instead of letting stb truncate them.
+    if (stbi_is_hdr_from_memory(file.data(), (int) file.size())) {
+        float* source = stbi_loadf_from_memory(file.data(), (int) file.size(), &width, &height, &channels, 0);
+        if (source == nullptr)
+            throw std::runtime_error("Image failed to load!");
+
+        quantized.resize((size_t) width * height * channels);
+        QuantizePixels(source, quantized.data(), width, height, channels, options.quantization);
+        stbi_image_free(source);
+        image = quantized.data();
+    }
+    else if (stbi_is_16_bit_from_memory(file.data(), (int) file.size())) {
+        uint16_t* source = stbi_load_16_from_memory(file.data(), (int) file.size(), &width, &height, &channels, 0);
+        if (source == nullptr)
+            throw std::runtime_error("Image failed to load!");
+
+        quantized.resize((size_t) width * height * channels);
+        QuantizePixels(source, quantized.data(), width, height, channels, options.quantization);
+        stbi_image_free(source);
+        image = quantized.data();
+    }
+    else {
+        loaded.reset(stbi_load_from_memory(file.data(), (int) file.size(), &width, &height, &channels, 0));
+        if (loaded == nullptr)
+            throw std::runtime_error("Image failed to load!");
+        image = loaded.get();
+    }
+
+    int pixel_size = 1;
+    if (options.detect_pixel_size) {
+        pixel_size = DetectPixelSize(image, width, height, channels, 0);
+        // No changes at all, any size works so long as it fits the image.
+        if (pixel_size == 0) pixel_size = std::gcd(width, height);
+    }
+
+    EStoozeyImageMode image_mode = ((channels == 2 || channels == 4) ? EStoozeyImageMode::RGBA : EStoozeyImageMode::RGB);
+    if (options.detect_image_mode)
+        image_mode = DetectImageMode(image, (size_t) width * height, channels);
+
+    std::vector<SStoozeyPixel> palette;
+    if (options.detect_palette && DetectPalette(image, (size_t) width * height, channels, image_mode, palette))
+        image_mode = EStoozeyImageMode::INDEXED;
+
+    SStoozeyHeader header {
+        .image_mode = image_mode,
+        .width = width,
+        .height = height,
+        .pixel_size = pixel_size,
+    };
+
+    auto stoz = std::make_shared<SStoz>(header);
+    if (image_mode == EStoozeyImageMode::INDEXED)
+        stoz->SetPalette(std::move(palette));
+    stoz->frames[0].LoadPixels(image, channels, (size_t) width * channels);
+
+    return stoz;
+}
+
+std::shared_ptr<SStoz> SStoz::FromPixels(SStoozeyHeader header, std::span<const uint8_t* const> frames, size_t stride, EStoozeyPixelFormat format) {
+    if (stride == 0)
+        stride = (size_t) header.width * GetBytesPerPixel(format);
+
+    header.frame_count = (int) frames.size();
+
+    auto stoz = std::make_shared<SStoz>(header);
+    ParallelFor(header.frame_count, [&](int i) {
+        stoz->frames[i].LoadPixels(frames[i], format, stride);
+    });
+
+    // Indexed images get their palette from whatever colors the frames turned out to use.
+    if (header.image_mode == EStoozeyImageMode::INDEXED) {
+        SStoozeyPaletteBuilder builder;
+        for (auto& frame : stoz->frames) {
+            for (const SStoozeyRunLength& run : frame.Runs()) {
+                if (!builder.Add(run.pixel))
+                    throw std::runtime_error("Too many colors for an indexed image!");
+            }
+        }
+
+        stoz->SetPalette(std::move(builder.colors));
+    }
+
+    return stoz;
+}
+
+std::shared_ptr<SStoz> SStoz::FromGif(const std::vector<uint8_t>& file, SStoozeyImportOptions options) {
+    int width, height, frame_count, channels;
+    int* delays = nullptr;
+    unsigned char* image = stbi_load_gif_from_memory(file.data(), (int) file.size(), &delays, &width, &height, &frame_count, &channels, 4);
+
+    if (image == nullptr)
+        throw std::runtime_error("Image failed to load!");
+
+    // The format only has the one frame duration, so use the average delay,
+    // which at least keeps the length of the whole animation intact.
+    long long total_delay = 0;
+    for (int i = 0; i < frame_count; ++i)
+        total_delay += delays[i];
+
+    size_t frame_stride = (size_t) width * height * 4;
+
+    int pixel_size = 1;
+    if (options.detect_pixel_size) {
+        pixel_size = 0;
+        for (int i = 0; i < frame_count && pixel_size != 1; ++i)
+            pixel_size = DetectPixelSize(image + (frame_stride * i), width, height, 4, pixel_size);
+        if (pixel_size == 0) pixel_size = std::gcd(width, height);
+    }
+
+    // Frames are laid out back to back, so they can be analyzed as one tall image.
+    EStoozeyImageMode image_mode = EStoozeyImageMode::RGBA;
+    if (options.detect_image_mode)
+        image_mode = DetectImageMode(image, frame_stride * frame_count / 4, 4);
+
+    std::vector<SStoozeyPixel> palette;
+    if (options.detect_palette && DetectPalette(image, frame_stride * frame_count / 4, 4, image_mode, palette))
+        image_mode = EStoozeyImageMode::INDEXED;
+
+    SStoozeyHeader header {
+        .image_mode = image_mode,
+        .width = width,
+        .height = height,
+        .pixel_size = pixel_size,
+        .frame_count = frame_count,
+        .frame_duration = (int) (total_delay / std::max(frame_count, 1)),
+    };
+
+    auto stoz = std::make_shared<SStoz>(header);
+    if (image_mode == EStoozeyImageMode::INDEXED)
+        stoz->SetPalette(std::move(palette));
+    ParallelFor(frame_count, [&](int i) {
+        stoz->frames[i].LoadPixels(image + (frame_stride * i), 4, (size_t) width * 4);
+    });
+
+    stbi_image_free(image);
+    STBI_FREE(delays);
+
+    return stoz;
+}
+
+void SStoz::SetImageMode(EStoozeyImageMode image_mode) {
+    this->headers[EStoozeyHeaderValue::IMAGE_MODE] = (int) image_mode;
+    for (auto& frame : this->frames)
+        frame.image_mode = image_mode;
+}
+
+struct SStoozeyWeightedColor {
+    uint8_t channels[4];
+    uint32_t weight;
+};
+
+static uint32_t GetSquaredDistance(const uint8_t* a, const uint8_t* b, int channels) {
+    uint32_t distance = 0;
+    for (int c = 0; c < channels; ++c) {
+        int delta = (int) a[c] - (int) b[c];
+        distance += delta * delta;
+    }
+    return distance;
+}
+
+static int FindNearestColor(const uint8_t* color, const std::vector<SStoozeyWeightedColor>& palette, int channels) {
+    int nearest = 0;
+    uint32_t nearest_distance = UINT32_MAX;
+    for (int i = 0; i < (int) palette.size(); ++i) {
+        uint32_t distance = GetSquaredDistance(color, palette[i].channels, channels);
+        if (distance < nearest_distance) {
+            nearest = i;
+            nearest_distance = distance;
+            if (distance == 0) break;
+        }
+    }
+    return nearest;
+}
+
+// Splits the box with the widest channel range at its weighted median until
+// there are enough boxes, each box becoming its weighted mean color.
+static std::vector<SStoozeyWeightedColor> MedianCut(std::vector<SStoozeyWeightedColor>& colors, int channels, int color_count, std::vector<int>& assignments) {
+    struct SBox { size_t begin, end; };
+    std::vector<SBox> boxes = { { 0, colors.size() } };
+
+    auto get_widest_channel = [&](const SBox& box, int& range) {
+        uint8_t min[4] = { 255, 255, 255, 255 }, max[4] = { 0, 0, 0, 0 };
+        for (size_t i = box.begin; i < box.end; ++i) {
+            for (int c = 0; c < channels; ++c) {
+                min[c] = std::min(min[c], colors[i].channels[c]);
+                max[c] = std::max(max[c], colors[i].channels[c]);
+            }
+        }
+
+        int widest = 0;
+        range = -1;
+        for (int c = 0; c < channels; ++c) {
+            if (max[c] - min[c] > range) {
+                range = max[c] - min[c];
+                widest = c;
+            }
+        }
+        return widest;
+    };
+
+    while ((int) boxes.size() < color_count) {
+        int best_box = -1, best_range = 0, best_channel = 0;
+        for (int i = 0; i < (int) boxes.size(); ++i) {
+            if (boxes[i].end - boxes[i].begin < 2) continue;
+            int range;
+            int channel = get_widest_channel(boxes[i], range);
+            if (range > best_range) {
+                best_box = i;
+                best_range = range;
+                best_channel = channel;
+            }
+        }
+
+        // Every box is down to a single color.
+        if (best_box < 0) break;
+
+        SBox box = boxes[best_box];
+        std::sort(colors.begin() + box.begin, colors.begin() + box.end, [&](const SStoozeyWeightedColor& a, const SStoozeyWeightedColor& b) {
+            return a.channels[best_channel] < b.channels[best_channel];
+        });
+
+        uint64_t total_weight = 0;
+        for (size_t i = box.begin; i < box.end; ++i)
+            total_weight += colors[i].weight;
+
+        size_t split = box.begin + 1;
+        uint64_t weight = colors[box.begin].weight;
+        while (split < box.end - 1 && weight * 2 < total_weight)
+            weight += colors[split++].weight;
+
+        boxes[best_box] = { box.begin, split };
+        boxes.push_back({ split, box.end });
+    }
+
+    std::vector<SStoozeyWeightedColor> palette;
+    palette.reserve(boxes.size());
+    for (size_t i = 0; i < boxes.size(); ++i) {
+        uint64_t sums[4] = { 0, 0, 0, 0 }, weight = 0;
+        for (size_t j = boxes[i].begin; j < boxes[i].end; ++j) {
+            for (int c = 0; c < 4; ++c)
+                sums[c] += (uint64_t) colors[j].channels[c] * colors[j].weight;
+            weight += colors[j].weight;
+            assignments[j] = i;
+        }
+
+        SStoozeyWeightedColor color = { .channels = {}, .weight = (uint32_t) std::min(weight, (uint64_t) UINT32_MAX) };
+        for (int c = 0; c < 4; ++c)
+            color.channels[c] = (uint8_t) ((sums[c] + (weight / 2)) / weight);
+        palette.push_back(color);
+    }
+
+    return palette;
+}
+
+// Moves every palette color to the weighted mean of the colors nearest to it,
+// splitting the assignment step over chunks of colors.
+static void RefineKMeans(const std::vector<SStoozeyWeightedColor>& colors, std::vector<SStoozeyWeightedColor>& palette, int channels, int iterations, std::vector<int>& assignments) {
+    constexpr size_t chunk_size = 4096;
+    int chunk_count = (int) ((colors.size() + chunk_size - 1) / chunk_size);
+
+    for (int iteration = 0; iteration <= iterations; ++iteration) {
+        ParallelFor(chunk_count, [&](int chunk) {
+            size_t end = std::min(colors.size(), (chunk + 1) * chunk_size);
+            for (size_t i = chunk * chunk_size; i < end; ++i)
+                assignments[i] = FindNearestColor(colors[i].channels, palette, channels);
+        });
+
+        // The last pass only assigns, so the mapping matches the final palette.
+        if (iteration == iterations) break;
+
+        std::vector<uint64_t> sums(palette.size() * 5, 0);
+        for (size_t i = 0; i < colors.size(); ++i) {
+            uint64_t* sum = &sums[assignments[i] * 5];
+            for (int c = 0; c < 4; ++c)
+                sum[c] += (uint64_t) colors[i].channels[c] * colors[i].weight;
+            sum[4] += colors[i].weight;
+        }
+
+        for (size_t i = 0; i < palette.size(); ++i) {
+            uint64_t* sum = &sums[i * 5];
+            if (sum[4] == 0) continue;
+            for (int c = 0; c < 4; ++c)
+                palette[i].channels[c] = (uint8_t) ((sum[c] + (sum[4] / 2)) / sum[4]);
+        }
+    }
+}
+
+SStoozeyQuantizeResult SStoz::Quantize(SStoozeyQuantizeOptions options) {
+    if (options.color_count < 1)
+        throw std::runtime_error("Can't quantize to less than one color!");
+
+    EStoozeyImageMode image_mode = this->GetImageMode();
+    int channels = (image_mode == EStoozeyImageMode::L) ? 1 : (image_mode == EStoozeyImageMode::RGB) ? 3 : 4;
+
+    // Frames sharing a grid only need quantizing once, and keep sharing the result.
+    std::vector<std::shared_ptr<SStoozeyGrid>> grids;
+    std::unordered_map<SStoozeyGrid*, int> grid_indices;
+    for (auto& frame : this->frames) {
+        if (grid_indices.emplace(frame.grid.get(), (int) grids.size()).second)
+            grids.push_back(frame.grid);
+    }
+
+    // Per grid histograms, counted over runs rather than cells, then merged.
+    std::vector<std::unordered_map<uint32_t, uint32_t>> histograms(grids.size());
+    ParallelFor((int) grids.size(), [&](int i) {
+        SStoozeyFrame& frame = *std::find_if(this->frames.begin(), this->frames.end(), [&](SStoozeyFrame& frame) {
+            return frame.grid == grids[i];
+        });
+
+        SStoozeyRunRange runs = { SStoozeyRunIterator(&frame) };
+        for (const SStoozeyRunLength& run : runs)
+            histograms[i][*((uint32_t*)&run.pixel)] += run.count;
+    });
+
+    if (grids.empty()) return {};
+
+    std::unordered_map<uint32_t, uint32_t> histogram = std::move(histograms[0]);
+    for (size_t i = 1; i < histograms.size(); ++i) {
+        for (auto& [color, count] : histograms[i])
+            histogram[color] += count;
+    }
+
+    std::vector<SStoozeyWeightedColor> colors;
+    colors.reserve(histogram.size());
+    for (auto& [color, count] : histogram) {
+        SStoozeyWeightedColor weighted = { .channels = {}, .weight = count };
+        memcpy(weighted.channels, &color, 4);
+        colors.push_back(weighted);
+    }
+
+    if (colors.empty()) return {};
+
+    std::vector<int> assignments(colors.size());
+    std::vector<SStoozeyWeightedColor> palette = MedianCut(colors, channels, options.color_count, assignments);
+    if (options.quantizer == EStoozeyQuantizer::KMEANS && palette.size() < colors.size())
+        RefineKMeans(colors, palette, channels, options.iterations, assignments);
+
+    // Only the channels the image mode stores take part, the rest follow suit.
+    for (auto& color : palette) {
+        if (channels == 1) color.channels[1] = color.channels[2] = color.channels[0];
+        if (channels < 4) color.channels[3] = 0xFF;
+    }
+
+    std::unordered_map<uint32_t, uint32_t> mapping;
+    mapping.reserve(colors.size());
+    double squared_error = 0.0;
+    uint64_t cell_count = 0;
+    for (size_t i = 0; i < colors.size(); ++i) {
+        const SStoozeyWeightedColor& target = palette[assignments[i]];
+        mapping[*((uint32_t*)colors[i].channels)] = *((uint32_t*)target.channels);
+        squared_error += (double) GetSquaredDistance(colors[i].channels, target.channels, channels) * colors[i].weight;
+        cell_count += colors[i].weight;
+    }
+
+    // Remap a tile of rows at a time into fresh grids, so nobody else holding
+    // the old ones, like a copy of this image, sees the lossy pixels.
+    std::vector<std::shared_ptr<SStoozeyGrid>> quantized(grids.size());
+    for (size_t i = 0; i < grids.size(); ++i)
+        quantized[i] = std::make_shared<SStoozeyGrid>(grids[i]->size(), SStoozeyRow(grids[i]->empty() ? 0 : (*grids[i])[0].size()));
+
+    constexpr int rows_per_tile = 64;
+    std::vector<std::tuple<int, int>> tiles;
+    for (int i = 0; i < (int) grids.size(); ++i) {
+        for (int y = 0; y < (int) grids[i]->size(); y += rows_per_tile)
+            tiles.push_back({ i, y });
+    }
+
+    ParallelFor((int) tiles.size(), [&](int tile) {
+        auto [grid_index, first_row] = tiles[tile];
+        const SStoozeyGrid& source = *grids[grid_index];
+        SStoozeyGrid& dest = *quantized[grid_index];
+
+        uint32_t last_color = 0, last_mapping = 0;
+        bool has_last = false;
+
+        int end = std::min((int) source.size(), first_row + rows_per_tile);
+        for (int y = first_row; y < end; ++y) {
+            const uint32_t* source_row = (const uint32_t*) source[y].data();
+            uint32_t* dest_row = (uint32_t*) dest.GetMutableRow(y).data();
+            for (size_t x = 0; x < source[y].size(); ++x) {
+                if (!has_last || source_row[x] != last_color) {
+                    last_color = source_row[x];
+                    last_mapping = mapping.at(last_color);
+                    has_last = true;
+                }
+                dest_row[x] = last_mapping;
+            }
+        }
+    });
+
+    for (auto& frame : this->frames) {
+        frame.grid = quantized[grid_indices[frame.grid.get()]];
+        frame.runs.clear();
+        frame.row_index.clear();
+        frame.has_stats = false;
+    }
+
+    std::vector<SStoozeyPixel> unique_colors;
+    std::unordered_set<uint32_t> seen;
+    for (auto& color : palette) {
+        if (seen.insert(*((uint32_t*)color.channels)).second)
+            unique_colors.push_back(*((SStoozeyPixel*)color.channels));
+    }
+
+    SStoozeyQuantizeResult result = { .color_count = (int) unique_colors.size() };
+    if (cell_count != 0)
+        result.mse = squared_error / ((double) cell_count * channels);
+    result.psnr = (result.mse == 0.0) ? INFINITY : 10.0 * std::log10((255.0 * 255.0) / result.mse);
+
+    if (options.use_palette && image_mode != EStoozeyImageMode::L && unique_colors.size() <= 256) {
+        this->SetImageMode(EStoozeyImageMode::INDEXED);
+        this->SetPalette(std::move(unique_colors));
+    }
+    else if (image_mode == EStoozeyImageMode::INDEXED) {
+        this->SetImageMode(EStoozeyImageMode::RGBA);
+        this->palette = nullptr;
+        for (auto& frame : this->frames)
+            frame.SetPalette(nullptr);
+    }
+
+    return result;
 }
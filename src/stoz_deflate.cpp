@@ -0,0 +1,493 @@
+#include "stoz_deflate.hpp"
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <queue>
+#include <stdexcept>
+#include <thread>
+#include <zlib.h>
+
+static const int window_size = 0x8000;
+static const int min_match = 3;
+static const int max_match = 258;
+// Input covered by one deflate block, and the unit of work for a thread.
+static const size_t block_size = 0x20000;
+// How far down a hash chain to look for matches, zopfli uses the same.
+static const int max_chain = 8192;
+
+static const uint16_t length_base[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const uint8_t length_extra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t distance_base[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const uint8_t distance_extra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+static const uint8_t code_length_order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+// Index into length_base for a match length.
+static int GetLengthIndex(int length) {
+    static const auto table = [] {
+        std::vector<uint8_t> table(max_match + 1, 0);
+        for (int index = 0; index < 29; ++index)
+            for (int length = length_base[index]; length <= max_match && (index == 28 || length < length_base[index + 1]); ++length)
+                table[length] = (uint8_t) index;
+        return table;
+    }();
+    return table[length];
+}
+
+static int GetDistanceIndex(int distance) {
+    if (distance <= 4) return distance - 1;
+    unsigned int value = distance - 1;
+    int log = std::bit_width(value) - 1;
+    return (log * 2) + ((value >> (log - 1)) & 1);
+}
+
+// Deflate packs bits starting from the least significant one, Huffman codes
+// go in starting from their most significant bit.
+class SStoozeyBitWriter {
+    public:
+        void Write(uint32_t value, int count) {
+            this->buffer |= (uint64_t) value << this->buffer_bits;
+            this->buffer_bits += count;
+            this->bit_count += count;
+            while (this->buffer_bits >= 8) {
+                this->data.push_back((uint8_t) this->buffer);
+                this->buffer >>= 8;
+                this->buffer_bits -= 8;
+            }
+        }
+
+        void WriteCode(uint32_t code, int length) {
+            uint32_t reversed = 0;
+            for (int i = 0; i < length; ++i)
+                reversed |= ((code >> i) & 1) << (length - 1 - i);
+            this->Write(reversed, length);
+        }
+
+        void Append(const SStoozeyBitWriter& other) {
+            for (uint8_t byte : other.data)
+                this->Write(byte, 8);
+            if (other.buffer_bits != 0)
+                this->Write((uint32_t) other.buffer, other.buffer_bits);
+        }
+
+        std::vector<uint8_t> Finish() {
+            if (this->buffer_bits != 0)
+                this->Write(0, 8 - this->buffer_bits);
+            return this->data;
+        }
+
+        size_t GetBitCount() const { return this->bit_count; }
+    private:
+        std::vector<uint8_t> data;
+        uint64_t buffer = 0;
+        int buffer_bits = 0;
+        size_t bit_count = 0;
+};
+
+// Huffman code lengths no longer than max_bits. When the tree comes out too
+// deep the frequencies are flattened and it's built again.
+static std::vector<uint8_t> BuildCodeLengths(std::vector<uint32_t> frequencies, int max_bits) {
+    std::vector<uint8_t> lengths(frequencies.size(), 0);
+    std::vector<int> used;
+    for (int i = 0; i < (int) frequencies.size(); ++i)
+        if (frequencies[i] != 0) used.push_back(i);
+
+    if (used.empty()) return lengths;
+    if (used.size() == 1) {
+        lengths[used[0]] = 1;
+        return lengths;
+    }
+
+    while (true) {
+        // Nodes past the leaves are internal, parents point upwards.
+        std::vector<int> parents(used.size() * 2, -1);
+        using SNode = std::pair<uint64_t, int>;
+        std::priority_queue<SNode, std::vector<SNode>, std::greater<SNode>> queue;
+        for (int i = 0; i < (int) used.size(); ++i)
+            queue.push({ frequencies[used[i]], i });
+
+        int next = (int) used.size();
+        while (queue.size() > 1) {
+            SNode a = queue.top(); queue.pop();
+            SNode b = queue.top(); queue.pop();
+            parents[a.second] = next;
+            parents[b.second] = next;
+            queue.push({ a.first + b.first, next++ });
+        }
+
+        int deepest = 0;
+        for (int i = 0; i < (int) used.size(); ++i) {
+            int depth = 0;
+            for (int node = i; parents[node] != -1; node = parents[node]) ++depth;
+            lengths[used[i]] = (uint8_t) depth;
+            deepest = std::max(deepest, depth);
+        }
+        if (deepest <= max_bits) return lengths;
+
+        for (int symbol : used)
+            frequencies[symbol] = (frequencies[symbol] >> 1) | 1;
+    }
+}
+
+static std::vector<uint32_t> BuildCodes(const std::vector<uint8_t>& lengths) {
+    uint32_t length_counts[16] = {};
+    for (uint8_t length : lengths) length_counts[length]++;
+    length_counts[0] = 0;
+
+    uint32_t next_code[16] = {};
+    uint32_t code = 0;
+    for (int bits = 1; bits < 16; ++bits) {
+        code = (code + length_counts[bits - 1]) << 1;
+        next_code[bits] = code;
+    }
+
+    std::vector<uint32_t> codes(lengths.size(), 0);
+    for (size_t i = 0; i < lengths.size(); ++i)
+        if (lengths[i] != 0) codes[i] = next_code[lengths[i]]++;
+    return codes;
+}
+
+// A literal when length is 1, otherwise a match.
+struct SStoozeySymbol {
+    uint16_t length;
+    uint16_t distance;
+};
+
+class SStoozeyBlockEncoder {
+    public:
+        // Matches may reach back before start, into the previous block or the dictionary.
+        SStoozeyBlockEncoder(const uint8_t* data, size_t start, size_t end) : data(data), start(start), end(end) {}
+
+        void FindMatches() {
+            size_t base = this->start > (size_t) window_size ? this->start - window_size : 0;
+            size_t count = this->end - base;
+
+            // Hash chains over three bytes, covering the window before the block too.
+            const int hash_bits = 15;
+            std::vector<int32_t> head(1 << hash_bits, -1);
+            std::vector<int32_t> previous(count, -1);
+            auto hash = [&](size_t position) {
+                uint32_t value = this->data[position] | (this->data[position + 1] << 8) | (this->data[position + 2] << 16);
+                return (value * 2654435761u) >> (32 - hash_bits);
+            };
+
+            this->match_offsets.assign(this->end - this->start + 1, 0);
+            this->matches.clear();
+
+            for (size_t position = base; position < this->end; ++position) {
+                bool in_block = position >= this->start;
+                if (in_block) this->match_offsets[position - this->start] = (uint32_t) this->matches.size();
+                if (position + min_match > this->end) continue;
+
+                uint32_t key = hash(position);
+                if (in_block) {
+                    // Every time a longer match turns up, note its distance. Any
+                    // shorter length is then best served by the first entry that reaches it.
+                    int limit = (int) std::min<size_t>(max_match, this->end - position);
+                    int best = min_match - 1;
+                    int chain = 0;
+                    for (int32_t candidate = head[key]; candidate != -1 && chain < max_chain; candidate = previous[candidate], ++chain) {
+                        size_t match = base + candidate;
+                        size_t distance = position - match;
+                        if (distance > (size_t) window_size) break;
+
+                        const uint8_t* a = this->data + position;
+                        const uint8_t* b = this->data + match;
+                        if (a[best] != b[best]) continue;
+                        int length = 0;
+                        while (length < limit && a[length] == b[length]) ++length;
+
+                        if (length > best) {
+                            best = length;
+                            this->matches.push_back({ (uint16_t) length, (uint16_t) distance });
+                            if (length == limit) break;
+                        }
+                    }
+                }
+
+                previous[position - base] = head[key];
+                head[key] = (int32_t) (position - base);
+            }
+            this->match_offsets[this->end - this->start] = (uint32_t) this->matches.size();
+        }
+
+        // Cheapest parse under the given bit costs of each symbol.
+        std::vector<SStoozeySymbol> Parse(const std::vector<float>& literal_costs, const std::vector<float>& distance_costs) {
+            size_t count = this->end - this->start;
+
+            float length_costs[max_match + 1] = {};
+            for (int length = min_match; length <= max_match; ++length) {
+                int index = GetLengthIndex(length);
+                length_costs[length] = literal_costs[257 + index] + length_extra[index];
+            }
+
+            std::vector<float> costs(count + 1, INFINITY);
+            std::vector<SStoozeySymbol> choices(count + 1);
+            costs[0] = 0;
+
+            for (size_t i = 0; i < count; ++i) {
+                float cost = costs[i];
+                float literal = cost + literal_costs[this->data[this->start + i]];
+                if (literal < costs[i + 1]) {
+                    costs[i + 1] = literal;
+                    choices[i + 1] = { 1, 0 };
+                }
+
+                int length = min_match;
+                for (uint32_t m = this->match_offsets[i]; m < this->match_offsets[i + 1]; ++m) {
+                    const SStoozeySymbol& match = this->matches[m];
+                    int distance_index = GetDistanceIndex(match.distance);
+                    float distance_cost = cost + distance_costs[distance_index] + distance_extra[distance_index];
+
+                    for (; length <= match.length; ++length) {
+                        float total = distance_cost + length_costs[length];
+                        if (total < costs[i + length]) {
+                            costs[i + length] = total;
+                            choices[i + length] = { (uint16_t) length, match.distance };
+                        }
+                    }
+                }
+            }
+
+            std::vector<SStoozeySymbol> symbols;
+            for (size_t i = count; i > 0; i -= choices[i].length)
+                symbols.push_back(choices[i]);
+            std::reverse(symbols.begin(), symbols.end());
+            return symbols;
+        }
+
+        // Writes the parse as a single block with the fixed Huffman code, which
+        // saves the code tables on tiny inputs.
+        void WriteFixed(SStoozeyBitWriter& writer, const std::vector<SStoozeySymbol>& symbols, bool final) {
+            std::vector<uint8_t> literal_lengths(288, 8), distance_lengths(30, 5);
+            std::fill(literal_lengths.begin() + 144, literal_lengths.begin() + 256, 9);
+            std::fill(literal_lengths.begin() + 256, literal_lengths.begin() + 280, 7);
+
+            writer.Write(final ? 1 : 0, 1);
+            writer.Write(1, 2);
+            this->WriteSymbols(writer, symbols, literal_lengths, distance_lengths);
+        }
+
+        // Writes the parse as a single dynamic Huffman block.
+        void Write(SStoozeyBitWriter& writer, const std::vector<SStoozeySymbol>& symbols, bool final) {
+            std::vector<uint32_t> literal_counts(286, 0), distance_counts(30, 0);
+            this->Count(symbols, literal_counts, distance_counts);
+
+            std::vector<uint8_t> literal_lengths = BuildCodeLengths(literal_counts, 15);
+            std::vector<uint8_t> distance_lengths = BuildCodeLengths(distance_counts, 15);
+
+            // Some inflaters reject a distance code with fewer than two symbols.
+            int used_distances = (int) std::count_if(distance_lengths.begin(), distance_lengths.end(), [](uint8_t length) { return length != 0; });
+            if (used_distances == 0) distance_lengths[0] = distance_lengths[1] = 1;
+            else if (used_distances == 1) distance_lengths[distance_lengths[0] != 0 ? 1 : 0] = 1;
+
+            int literal_count = 286;
+            while (literal_count > 257 && literal_lengths[literal_count - 1] == 0) --literal_count;
+            int distance_count = 30;
+            while (distance_count > 1 && distance_lengths[distance_count - 1] == 0) --distance_count;
+
+            // The code lengths themselves, run-length encoded with symbols 16 to 18.
+            std::vector<uint8_t> lengths(literal_lengths.begin(), literal_lengths.begin() + literal_count);
+            lengths.insert(lengths.end(), distance_lengths.begin(), distance_lengths.begin() + distance_count);
+
+            std::vector<std::pair<uint8_t, uint8_t>> length_symbols;
+            for (size_t i = 0; i < lengths.size();) {
+                size_t run = 1;
+                while (i + run < lengths.size() && lengths[i + run] == lengths[i]) ++run;
+
+                if (lengths[i] == 0 && run >= 3) {
+                    run = std::min<size_t>(run, 138);
+                    if (run >= 11) length_symbols.push_back({ 18, (uint8_t) (run - 11) });
+                    else length_symbols.push_back({ 17, (uint8_t) (run - 3) });
+                    i += run;
+                    continue;
+                }
+
+                length_symbols.push_back({ lengths[i], 0 });
+                i++;
+                run--;
+                if (lengths[i - 1] != 0) {
+                    while (run >= 3) {
+                        size_t repeat = std::min<size_t>(run, 6);
+                        length_symbols.push_back({ 16, (uint8_t) (repeat - 3) });
+                        i += repeat;
+                        run -= repeat;
+                    }
+                }
+            }
+
+            std::vector<uint32_t> length_counts(19, 0);
+            for (auto& symbol : length_symbols) length_counts[symbol.first]++;
+            std::vector<uint8_t> length_lengths = BuildCodeLengths(length_counts, 7);
+            std::vector<uint32_t> length_codes = BuildCodes(length_lengths);
+
+            int length_code_count = 19;
+            while (length_code_count > 4 && length_lengths[code_length_order[length_code_count - 1]] == 0) --length_code_count;
+
+            writer.Write(final ? 1 : 0, 1);
+            writer.Write(2, 2);
+            writer.Write(literal_count - 257, 5);
+            writer.Write(distance_count - 1, 5);
+            writer.Write(length_code_count - 4, 4);
+            for (int i = 0; i < length_code_count; ++i)
+                writer.Write(length_lengths[code_length_order[i]], 3);
+
+            for (auto& [symbol, extra] : length_symbols) {
+                writer.WriteCode(length_codes[symbol], length_lengths[symbol]);
+                if (symbol == 16) writer.Write(extra, 2);
+                else if (symbol == 17) writer.Write(extra, 3);
+                else if (symbol == 18) writer.Write(extra, 7);
+            }
+
+            this->WriteSymbols(writer, symbols, literal_lengths, distance_lengths);
+        }
+
+        void WriteSymbols(SStoozeyBitWriter& writer, const std::vector<SStoozeySymbol>& symbols, const std::vector<uint8_t>& literal_lengths, const std::vector<uint8_t>& distance_lengths) {
+            std::vector<uint32_t> literal_codes = BuildCodes(literal_lengths);
+            std::vector<uint32_t> distance_codes = BuildCodes(distance_lengths);
+
+            size_t position = this->start;
+            for (const SStoozeySymbol& symbol : symbols) {
+                if (symbol.length == 1) {
+                    uint8_t literal = this->data[position];
+                    writer.WriteCode(literal_codes[literal], literal_lengths[literal]);
+                }
+                else {
+                    int length_index = GetLengthIndex(symbol.length);
+                    writer.WriteCode(literal_codes[257 + length_index], literal_lengths[257 + length_index]);
+                    writer.Write(symbol.length - length_base[length_index], length_extra[length_index]);
+
+                    int distance_index = GetDistanceIndex(symbol.distance);
+                    writer.WriteCode(distance_codes[distance_index], distance_lengths[distance_index]);
+                    writer.Write(symbol.distance - distance_base[distance_index], distance_extra[distance_index]);
+                }
+                position += symbol.length;
+            }
+            writer.WriteCode(literal_codes[256], literal_lengths[256]);
+        }
+
+        void Count(const std::vector<SStoozeySymbol>& symbols, std::vector<uint32_t>& literal_counts, std::vector<uint32_t>& distance_counts) {
+            size_t position = this->start;
+            for (const SStoozeySymbol& symbol : symbols) {
+                if (symbol.length == 1) literal_counts[this->data[position]]++;
+                else {
+                    literal_counts[257 + GetLengthIndex(symbol.length)]++;
+                    distance_counts[GetDistanceIndex(symbol.distance)]++;
+                }
+                position += symbol.length;
+            }
+            literal_counts[256]++;
+        }
+
+        SStoozeyBitWriter Encode(int iterations, bool final) {
+            this->FindMatches();
+
+            // Start from the costs of the fixed Huffman code.
+            std::vector<float> literal_costs(286), distance_costs(30, 5.0f);
+            for (int i = 0; i < 286; ++i)
+                literal_costs[i] = (i < 144) ? 8.0f : (i < 256) ? 9.0f : (i < 280) ? 7.0f : 8.0f;
+
+            SStoozeyBitWriter best;
+            bool has_best = false;
+            for (int iteration = 0; iteration < std::max(iterations, 1); ++iteration) {
+                std::vector<SStoozeySymbol> symbols = this->Parse(literal_costs, distance_costs);
+
+                SStoozeyBitWriter writer, fixed;
+                this->Write(writer, symbols, final);
+                this->WriteFixed(fixed, symbols, final);
+                for (SStoozeyBitWriter* candidate : { &writer, &fixed }) {
+                    if (!has_best || candidate->GetBitCount() < best.GetBitCount()) {
+                        best = std::move(*candidate);
+                        has_best = true;
+                    }
+                }
+
+                // Symbols this parse used a lot get cheaper for the next one.
+                std::vector<uint32_t> literal_counts(286, 0), distance_counts(30, 0);
+                this->Count(symbols, literal_counts, distance_counts);
+                auto update = [](std::vector<float>& costs, const std::vector<uint32_t>& counts) {
+                    uint64_t total = 0;
+                    for (uint32_t count : counts) total += count;
+                    float unused = std::log2((float) std::max<uint64_t>(total, 1)) + 1.0f;
+                    for (size_t i = 0; i < costs.size(); ++i)
+                        costs[i] = counts[i] != 0 ? std::log2((float) total / counts[i]) : unused;
+                };
+                update(literal_costs, literal_counts);
+                update(distance_costs, distance_counts);
+            }
+
+            return best;
+        }
+    private:
+        const uint8_t* data;
+        size_t start;
+        size_t end;
+
+        // Matches starting at block position i are matches[match_offsets[i]..match_offsets[i + 1]).
+        std::vector<uint32_t> match_offsets;
+        std::vector<SStoozeySymbol> matches;
+};
+
+std::vector<uint8_t> DeflateOptimal(std::span<const uint8_t> data, std::span<const uint8_t> dictionary, int iterations) {
+    // The dictionary is just history in front of the data, only its last
+    // window matters. Its id is still taken over all of it, like zlib does.
+    std::span<const uint8_t> history = dictionary;
+    if (history.size() > (size_t) window_size)
+        history = history.subspan(history.size() - window_size);
+    std::vector<uint8_t> input(history.begin(), history.end());
+    input.insert(input.end(), data.begin(), data.end());
+
+    size_t block_count = std::max<size_t>(1, (data.size() + block_size - 1) / block_size);
+    std::vector<SStoozeyBitWriter> blocks(block_count);
+
+    std::atomic<size_t> next_block = 0;
+    std::atomic<bool> failed = false;
+    auto worker = [&]() {
+        try {
+            for (size_t block = next_block++; block < block_count && !failed; block = next_block++) {
+                size_t start = history.size() + (block * block_size);
+                size_t end = std::min(start + block_size, input.size());
+                SStoozeyBlockEncoder encoder(input.data(), start, end);
+                blocks[block] = encoder.Encode(iterations, block == block_count - 1);
+            }
+        }
+        catch (...) {
+            failed = true;
+        }
+    };
+
+    int thread_count = (int) std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), block_count);
+    std::vector<std::thread> threads;
+    for (int i = 1; i < thread_count; ++i)
+        threads.emplace_back(worker);
+    worker();
+    for (auto& thread : threads)
+        thread.join();
+    if (failed)
+        throw std::runtime_error("Failed to compress image data!");
+
+    // Header for a 32K window at maximum compression, with the dictionary id if there is one.
+    uint8_t cmf = 0x78;
+    uint8_t flg = 0xC0 | (dictionary.empty() ? 0 : 0x20);
+    if (((cmf << 8) | flg) % 31 != 0)
+        flg += 31 - (((cmf << 8) | flg) % 31);
+
+    std::vector<uint8_t> output = { cmf, flg };
+    auto write_adler = [&](uint32_t adler) {
+        for (int shift = 24; shift >= 0; shift -= 8)
+            output.push_back((uint8_t) (adler >> shift));
+    };
+    if (!dictionary.empty())
+        write_adler((uint32_t) adler32(1, dictionary.data(), (uInt) dictionary.size()));
+
+    SStoozeyBitWriter writer;
+    for (auto& block : blocks)
+        writer.Append(block);
+    std::vector<uint8_t> body = writer.Finish();
+    output.insert(output.end(), body.begin(), body.end());
+
+    write_adler((uint32_t) adler32(1, data.data(), (uInt) data.size()));
+    return output;
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <vector>
+#include <span>
+#include <cstdint>
+
+// Slow deflate encoder for release builds. It finds every match at every
+// position and then runs a shortest path search over them, re-weighted by the
+// symbol statistics of the previous pass, like zopfli does. The output is a
+// standard zlib stream. Independent blocks are encoded in parallel.
+std::vector<uint8_t> DeflateOptimal(std::span<const uint8_t> data, std::span<const uint8_t> dictionary, int iterations);
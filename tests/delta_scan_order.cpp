@@ -0,0 +1,43 @@
+#include <stoz.hpp>
+#include <fstream>
+#include <iostream>
+
+// Delta frames under every scan order. The second frame changes everywhere,
+// so it falls back to a full frame, which has to be written in the scan
+// order the header records. The third only changes in a corner.
+int main() {
+    const int width = 37, height = 21, frame_count = 3;
+    std::vector<std::vector<uint8_t>> pixels(frame_count, std::vector<uint8_t>(width * height * 4));
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            uint8_t* first = &pixels[0][(y * width + x) * 4];
+            uint8_t* second = &pixels[1][(y * width + x) * 4];
+            uint8_t* third = &pixels[2][(y * width + x) * 4];
+            first[0] = (uint8_t) ((x / 5) * 40); first[1] = (uint8_t) ((y / 3) * 30); first[2] = 0; first[3] = 0xFF;
+            second[0] = (uint8_t) ((y / 4) * 50); second[1] = 0x80; second[2] = (uint8_t) ((x / 7) * 35); second[3] = 0xFF;
+            for (int c = 0; c < 4; ++c) third[c] = second[c];
+            if (x < 6 && y < 4) third[1] = 0x10;
+        }
+    }
+
+    const uint8_t* frames[frame_count] = { pixels[0].data(), pixels[1].data(), pixels[2].data() };
+    auto stoz = SStoz::FromPixels({ .image_mode = EStoozeyImageMode::RGBA, .width = width, .height = height }, frames, 0, EStoozeyPixelFormat::RGBA8);
+
+    int failures = 0;
+    for (auto encoding : { EStoozeyEncoding::RLE, EStoozeyEncoding::PACKBITS }) {
+        for (auto scan_order : { EStoozeyScanOrder::ROW, EStoozeyScanOrder::COLUMN, EStoozeyScanOrder::ZORDER, EStoozeyScanOrder::HILBERT }) {
+            std::vector<uint8_t> file = stoz->Pack({ .encoding = encoding, .scan_order = scan_order, .delta_frames = true });
+            std::ofstream("delta_scan_order.stoz", std::ios::out | std::ios::binary).write((const char*) file.data(), file.size());
+
+            auto loaded = SStoz::Load("delta_scan_order.stoz");
+            for (int i = 0; i < frame_count; ++i) {
+                if (loaded->GetImageData(i) != pixels[i]) {
+                    std::cerr << "Frame " << i << " doesn't round trip with encoding " << (int) encoding << " and scan order " << (int) scan_order << std::endl;
+                    failures++;
+                }
+            }
+        }
+    }
+
+    return failures == 0 ? 0 : 1;
+}
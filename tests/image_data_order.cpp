@@ -0,0 +1,31 @@
+#include <stoz.hpp>
+#include <fstream>
+#include <iostream>
+
+// GetImageData hands pixels back in the same row-major order FromPixels
+// takes them in, before and after a round trip through a file.
+int main() {
+    const int width = 5, height = 3;
+    std::vector<uint8_t> pixels(width * height * 3);
+    for (int i = 0; i < width * height; ++i) {
+        pixels[i * 3 + 0] = (uint8_t) (i * 16);
+        pixels[i * 3 + 1] = (uint8_t) (255 - i);
+        pixels[i * 3 + 2] = (uint8_t) (i & 1);
+    }
+
+    const uint8_t* frames[] = { pixels.data() };
+    auto stoz = SStoz::FromPixels({ .image_mode = EStoozeyImageMode::RGB, .width = width, .height = height }, frames, 0, EStoozeyPixelFormat::RGB8);
+    if (stoz->GetImageData(0) != pixels) {
+        std::cerr << "GetImageData doesn't match the source pixels" << std::endl;
+        return 1;
+    }
+
+    std::vector<uint8_t> file = stoz->Pack();
+    std::ofstream("image_data_order.stoz", std::ios::out | std::ios::binary).write((const char*) file.data(), file.size());
+    if (SStoz::Load("image_data_order.stoz")->GetImageData(0) != pixels) {
+        std::cerr << "GetImageData doesn't match the source pixels after loading" << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
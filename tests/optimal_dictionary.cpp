@@ -0,0 +1,48 @@
+#include <stoz.hpp>
+#include <fstream>
+#include <iostream>
+
+// A registered dictionary longer than deflate's 32K window, used by both
+// deflate encoders. Only the end of it is used as history, but the id in the
+// stream has to cover all of it for the loader to accept it.
+int main() {
+    const int width = 48, height = 48;
+    std::vector<uint8_t> pixels(width * height * 4);
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            uint8_t* pixel = &pixels[(y * width + x) * 4];
+            pixel[0] = (uint8_t) ((x * 7) ^ (y * 3));
+            pixel[1] = (uint8_t) (x + y);
+            pixel[2] = (uint8_t) ((x / 4) * 20);
+            pixel[3] = 0xFF;
+        }
+    }
+
+    std::vector<uint8_t> dictionary(0xC000);
+    for (size_t i = 0; i < dictionary.size(); ++i)
+        dictionary[i] = (uint8_t) ((i * 2654435761u) >> 13);
+    SStoz::RegisterDictionary(1, dictionary);
+
+    const uint8_t* frames[] = { pixels.data() };
+    auto stoz = SStoz::FromPixels({ .image_mode = EStoozeyImageMode::RGBA, .width = width, .height = height }, frames, 0, EStoozeyPixelFormat::RGBA8);
+
+    int failures = 0;
+    for (bool optimal_deflate : { false, true }) {
+        std::vector<uint8_t> file = stoz->Pack({ .encoding = EStoozeyEncoding::FILTERED, .dictionary = 1, .optimal_deflate = optimal_deflate, .optimal_iterations = 2 });
+        std::ofstream("optimal_dictionary.stoz", std::ios::out | std::ios::binary).write((const char*) file.data(), file.size());
+
+        try {
+            auto loaded = SStoz::Load("optimal_dictionary.stoz");
+            if (loaded->GetDictionary() != 1 || loaded->GetImageData(0) != pixels) {
+                std::cerr << "Image doesn't round trip with optimal_deflate " << optimal_deflate << std::endl;
+                failures++;
+            }
+        }
+        catch (const std::exception& e) {
+            std::cerr << "Failed to load with optimal_deflate " << optimal_deflate << ": " << e.what() << std::endl;
+            failures++;
+        }
+    }
+
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,32 @@
+#include <stoz.hpp>
+#include <fstream>
+#include <iostream>
+
+// Builds a preset deflate dictionary out of a corpus of STOZ files, to be
+// loaded and handed to SStoz::RegisterDictionary by whatever packs and loads them.
+int main(int argc, char** argv) {
+    if (argc < 4) {
+        std::cerr << "Usage: " << argv[0] << " <output> <size> <file.stoz>..." << std::endl;
+        return 1;
+    }
+
+    std::vector<std::string> filenames(argv + 3, argv + argc);
+    std::vector<uint8_t> dictionary;
+    try {
+        dictionary = SStoz::TrainDictionary(filenames, std::stoul(argv[2]));
+    }
+    catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+
+    std::ofstream stream(argv[1], std::ios::out | std::ios::binary);
+    stream.write((const char*) dictionary.data(), dictionary.size());
+    if (!stream.good()) {
+        std::cerr << "Failed to write " << argv[1] << std::endl;
+        return 1;
+    }
+
+    std::cout << "Wrote " << dictionary.size() << " bytes from " << filenames.size() << " files" << std::endl;
+    return 0;
+}